@@ -17,10 +17,48 @@
 /*----------------------------------------------------------------------------*/
 
 /*----------------------------------------------------------------------------*/
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include "twlopt.h"
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#define mkdir(path, mode) _mkdir(path)
+#define getpid() _getpid()
+#else
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLZ_SIMD
+#include <immintrin.h>
+#endif
+#ifdef TWL_BENCH
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
 
 /*----------------------------------------------------------------------------*/
 #define CMD_DECODE    0x00       // decode
@@ -28,6 +66,38 @@
 
 #define BLZ_NORMAL    0          // normal mode
 #define BLZ_BEST      1          // best mode
+#define BLZ_OPTIMAL   2          // optimal parse mode
+#define BLZ_MODES     3
+#define BLZ_EXHAUSTIVE 3         // every variant below, keeping the smallest
+
+#define BLZ_PADDED    0x10       // flag, split point chosen on the padded length
+#define BLZ_NOHEAD    0x20       // flag, no 16KB ARM9 head kept uncompressed
+#define BLZ_FAST      0x40       // flag, optimal parse fastest to decode within a BLZ_Budget
+
+#define ARM9_PARAMS   0x3000     // module params have to start below this in the ARM9
+#define DONOR_SDK     5          // SDK the donor ROMs are all built with
+#define DONOR_DIR     "a7donors/dsiware" // donor ROMs, "camerawifi" set inside
+
+#define DSI_WIRELESS  0x18       // header 0x1BF, Wi-Fi Connection / DS Wireless icon shown
+#define DSI_CAMERA    0x1400     // header 0x1B4, signs and writes its own photos
+#define DSI_DEBUG_KEY 0x04       // header 0x1C, modcrypted with the debug key
+#define DSI_DEVELOPER 0x80       // header 0x1BF, the same for developer titles
+#define DSI_HEADER    0x1000     // header size, key Y and the modcrypt areas are in it
+
+#define OVT_ENTRY     0x20       // overlay table entry size
+#define OVT_COMPRESSED 0x01      // flags (entry byte 0x1F), compressed size at 0x1C
+#define OVT_DIGEST    0x02       // contents are covered by a digest
+
+#define ARENA_ALIGN   16         // every arena allocation starts on this
+#define ARENA_HEAD    ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_BLOCK   0x00100000 // smallest block, 1MB
+
+#define BLZ_CACHE_MAGIC   0x435A4C42 // "BLZC"
+#define BLZ_CACHE_VERSION 1          // bump whenever BLZ_Code output changes
+
+#define REPORT_NONE   0          // no per-ROM report
+#define REPORT_JSON   1          // out/<rom>/report.json
+#define REPORT_CSV    2          // out/<rom>/report.csv
 
 #define BLZ_SHIFT     1          // bits to shift
 #define BLZ_MASK      0x80       // bits to check:
@@ -37,6 +107,42 @@
 #define BLZ_N         0x1002     // max offset ((1 << 12) + 2)
 #define BLZ_F         0x12       // max coded ((1 << 4) + BLZ_THRESHOLD)
 
+#define BLZ_LIT_BITS  9          // literal cost: 8 data bits + 1 flag bit
+#define BLZ_PAIR_BITS 17         // match cost: 16 data bits + 1 flag bit
+
+#define BLZ_HASH_BITS 16         // hash chain heads, keyed on 3 bytes
+#define BLZ_WINDOW    0x2000     // hash chain links, power of 2 above BLZ_N
+#define BLZ_CHAIN     8          // chain links walked before blzScan may take over,
+#define BLZ_DENSITY   8          // when they're at least 1 in 8 of the window so far
+#define BLZ_HASH(p)   ((((p)[0] | ((p)[-1] << 8) | ((p)[-2] << 16)) * 0x9E3779B1u) \
+                        >> (32 - BLZ_HASH_BITS))  // 3 bytes read downwards
+
+#define BLZ_ISA_SCALAR 0         // match scan kernels, chains only
+#define BLZ_ISA_SSE2   1
+#define BLZ_ISA_AVX2   2
+
+#define BLZ_GROWTH    5          // BLZ_FAST default, 0.5% over BLZ_NORMAL
+#define BLZ_WEIGHT    0x10000    // BLZ_FAST bit price at which only the size counts
+
+#define EST_SAMPLE    0x1000     // --estimate window, coded with BLZ_N bytes above it as history
+#define EST_SAMPLES   64         // most windows sampled from each ARM9 binary
+#define EST_HASH_BITS 12         // hash heads,
+#define EST_WAYS      2          // each keeping the last few positions
+// EST_SCALE and EST_BIAS were fitted on the bench buffers and sample ARM9 binaries, which the model
+// put 3-19% over BLZ_NORMAL: the middle of that, and half its width with room for the sampling
+#define EST_SCALE     905        // BLZ_NORMAL size per 1000 of the model's
+#define EST_BIAS      100        // and how far off that can be, per 1000
+
+// Decode cost model of the SDK's bottom-up decoder on the ARM9, in cycles
+#define CYC_ARM9_HZ   67027964   // ARM9 clock
+#define CYC_FLAG      4          // flag byte, every 8 tokens
+#define CYC_TOKEN     8          // flag test and loop, every token
+#define CYC_LITERAL   6          // literal byte copied
+#define CYC_MATCH     10         // match pair read and decoded
+#define CYC_COPY      7          // every byte a match copies
+#define CYC_FAR       24         // a match reading back further than CYC_NEAR,
+#define CYC_NEAR      0x400      // most likely missing the read-allocate data cache
+
 #define RAW_MINIM     0x00000000 // empty file, 0 bytes
 #define RAW_MAXIM     0x00FFFFFF // 3-bytes length, 16MB - 1
 
@@ -48,473 +154,2791 @@
                                  // 0x00FFFFFF + 0x00200000 + 12 + padding
 
 /*----------------------------------------------------------------------------*/
-bool moduleParamsFound = false;
-int sdkVer[2];
-char titleID[4] = {0};
-unsigned int a7mbk6 = 0;
-unsigned int deviceListAddr = 0;
+typedef struct {
+  unsigned int *head;            // last position + 1 for each hash, 0 = none
+  unsigned int *prev;            // previous position + 1 with the same hash
+  unsigned int  next;            // first position not yet in the chains
+} BLZ_Finder;
+
+// Rest of a match search, from window position 'pos' up to 'max'
+typedef void (*BLZ_ScanFn)(unsigned char *raw, unsigned int pos, unsigned int max, unsigned int lim,
+                           unsigned int top, unsigned int *len_best, unsigned int *pos_best);
+
+typedef struct {
+  unsigned char  *raw_top;       // last input byte, where position 0 is
+  unsigned int    raw_end;
+  unsigned char  *tab_len;       // longest match length at each position
+  unsigned short *tab_pos;       // and its offset
+  unsigned int    start, end;    // positions this chunk fills in
+} BLZ_Chunk;
+
+// XORs 'blocks' AES-CTR blocks into 'buffer' and advances 'ctr', which is in
+// AES byte order. The keystream is byte reversed, as the DSi's AES engine has it.
+typedef void (*ModcryptFn)(const unsigned char *rk, unsigned char *ctr, unsigned char *buffer, unsigned int blocks);
+
+// What BLZ_FAST may give up for decode time: size over BLZ_NORMAL, or else
+// the smallest output that decodes within a number of cycles
+typedef struct {
+  unsigned int        growth;    // most extra size, in 1/1000ths of the BLZ_NORMAL output
+  unsigned long long  cycles;    // decode cycle ceiling, 0 = growth applies
+} BLZ_Budget;
+
+// One BLZ_Code call to run on its own thread. The input is only read, so
+// tasks may share it.
+typedef struct {
+  unsigned char  *raw_buffer;
+  int             raw_len;
+  int             mode, threads;
+  BLZ_Budget     *budget;        // for BLZ_FAST, may be NULL
+  unsigned char  *pak_buffer;
+  int             pak_len;
+  void           *stats;         // BLZ_Stats, may be NULL
+} BLZ_Task;
+
+// Scratch memory handed out back to back and given back all at once. Reset
+// between ROMs, it keeps a single block as big as the most any ROM needed, so
+// a batch stops allocating once it has seen its largest ROM.
+typedef struct ArenaBlock {
+  struct ArenaBlock *prev;       // block filled before this one
+  size_t             size, used;
+} ArenaBlock;
+
+typedef struct {
+  ArenaBlock *block;             // block being filled, NULL before the first use
+  size_t      used;              // bytes handed out, over all blocks
+  size_t      peak;              // most handed out at once since the last reset
+  size_t      most;              // largest peak so far, the size reset keeps
+} Arena;
+
+typedef struct {
+  ArenaBlock *block;
+  size_t      blockUsed, used;
+} ArenaMark;
+
+/*----------------------------------------------------------------------------*/
+// Header fields the tool works with
+typedef struct {
+	char titleID[4];                // 0x0C, game code
+	unsigned int arm9src;           // 0x20
+	unsigned int arm9entry;         // 0x24
+	unsigned int arm9dst;           // 0x28
+	unsigned int arm9len;           // 0x2C
+	unsigned int arm7src;           // 0x30
+	unsigned int arm7entry;         // 0x34
+	unsigned int arm7dst;           // 0x38
+	unsigned int arm7len;           // 0x3C
+	unsigned int a7mbk6;            // 0x1A0
+	unsigned int arm9isrc;          // 0x1C0
+	unsigned int arm9idst;          // 0x1C8
+	unsigned int arm9ilen;          // 0x1CC
+	unsigned int arm7isrc;          // 0x1D0
+	unsigned int deviceListAddr;    // 0x1D4
+	unsigned int arm7idst;          // 0x1D8
+	unsigned int arm7ilen;          // 0x1DC
+} NdsHeader;
+
+// A ROM opened once and kept in memory, read-only
+typedef struct {
+	unsigned char *data;
+	unsigned int size;
+	bool mapped;                    // data is a file mapping, not a heap copy
+	bool borrowed;                  // data belongs to the caller, not freed
+	NdsHeader header;
+} RomHandle;
+
+// A block of the ROM moved by the rebuild: header-referenced data or a FAT file
+typedef struct {
+	unsigned int src, len;          // where it sits in the source ROM
+	unsigned char *data;            // what gets written, NULL when an identical block already is
+	unsigned int size;
+	unsigned int align;
+	unsigned int dst;               // where it goes in the rebuilt ROM
+	int field;                      // header offset of its offset word, or -1
+	int sizeField;                  // header offset of its size word, or -1
+	int fatIndex;                   // FAT entry, or -1
+	bool twl;                       // lives in the TWL region
+} RomItem;
+
+/*----------------------------------------------------------------------------*/
+// Compressor counters, and where its time went in seconds
+typedef struct {
+	unsigned long long searched;    // positions searched for a match
+	unsigned long long matches;     // matches emitted
+	unsigned long long matchBytes;  // bytes covered by them
+	unsigned long long literals;    // literals emitted
+	double table, parse, encode;
+} BLZ_Stats;
+
+// Per-ROM stage timings in seconds and byte counts, for --report
+typedef struct {
+	double open, triage, load, scan, compress, verify, saveArm9;
+	double donor, saveArm7, base, rebuild, total;
+	unsigned long long bytesRead, bytesWritten;
+	unsigned long long arenaPeak;   // most scratch memory in use at once
+	unsigned long long decodeCycles; // estimated, ARM9 binary
+	unsigned long long overlayCycles; // and the overlays together
+	bool cacheHit;
+	BLZ_Stats blz;
+} JobStats;
+
+/*----------------------------------------------------------------------------*/
+// A donor ROM's ARM7 side, opened once for the whole batch
+typedef struct {
+	int sdkVer[2];                  // SDK version, from its module params
+	bool cameraWifi;                // from the camerawifi donor set
+	char name[300];                 // donor ROM path
+	RomHandle rom;
+	unsigned char *arm7, *arm7i;    // views into the donor ROM
+	unsigned int arm7Len, arm7iLen;
+	char arm7Saved[300];            // first arm7.bin/arm7i.bin written from it
+	char arm7iSaved[300];
+	unsigned char *arm7iPlain;      // decrypted copy arm7i points to, when it's modcrypted
+} Donor;
+
+// Every usable donor ROM, found once at startup
+typedef struct {
+	Donor **donors;
+	int count;
+	bool link;                      // hardlink later arm7.bin/arm7i.bin to the first ones
+	bool quiet;                     // no line for each donor ROM not used
+	pthread_mutex_t lock;
+} DonorCache;
+
+/*----------------------------------------------------------------------------*/
+// Per-ROM state, so that several ROMs can go through the pipeline at once
+typedef struct {
+	char *romName;                  // source ROM path
+	char  tag[128];                 // ROM name without extension, prefixes log lines
+	void (*log)(void *user, const char *line); // where log lines go instead, when set
+	void *logUser;
+	char  folderName[256];
+	char  outName9[300];
+	char  outName7[300];
+	char  outName7i[300];
+	char  outNameBase[300];
+	char  outNameRom[300];
+
+	RomHandle rom;
+	unsigned int memNeed;           // estimated peak memory use, in bytes
+	Arena *arena;                   // the worker's scratch memory, given back after the job
+
+	bool skip;                      // sorted out by JobTriage, nothing to do
+	bool moduleParamsFound;
+	bool arm9Compressed;            // module params say it's compressed already
+	bool cameraWifi;                // uses the camera or wireless, per its header
+	int sdkVer[2];
+	unsigned int a7mbk6;
+	unsigned int deviceListAddr;
+
+	unsigned char *arm9;            // new binaries for the rebuilt ROM, NULL keeps the ROM's own
+	unsigned int arm9Len;
+	unsigned char *arm7, *arm7i;
+	unsigned int arm7Len, arm7iLen;
+	unsigned char *ovt;             // ARM9 overlay table with compressed entries
+	unsigned char **fileData;       // compressed files by FAT index, NULL if unchanged
+	unsigned int *fileLen;
+	Donor *donor;                   // NULL when no donor was found
+
+	bool estimated;                 // --estimate got as far as the savings
+	unsigned int romSize;           // kept after the ROM is closed
+	long long saving;               // bytes it expects the ROM to lose
+	unsigned int savingError;       // give or take
+
+	JobStats stats;
+} RomJob;
+
+typedef struct {
+	RomJob *jobs;
+	int count;
+	int next;                       // first job not yet taken by a worker
+	int mode;
+	BLZ_Budget budget;              // for BLZ_FAST
+	int blzThreads;                 // threads for each ARM9 compression
+	bool writeBase;                 // also write base.nds for TinkeDSi
+	bool basePatch;                 // as base.ips for the original ROM instead
+	bool verify;                    // decode each ARM9 back and compare it
+	bool overlays;                  // compress the ARM9 overlays too
+	bool estimate;                  // only guess what each ROM would save
+	int report;                     // REPORT_NONE, REPORT_JSON or REPORT_CSV
+	char *cacheDir;                 // compressed ARM9 cache, NULL if none
+	DonorCache donors;
+
+	unsigned long long memBudget;   // in bytes, 0 = no limit
+	unsigned long long memInUse;
+
+	pthread_mutex_t lock;
+	pthread_cond_t freed;
+} JobPool;
+
+pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+unsigned int    cacheStores = 0;  // numbers the cache's temporary files
+bool            cacheFailed = false;
+
+int             blzIsa = -1;     // match scan kernel, -1 = the best the CPU has
+BLZ_ScanFn      blzScan = NULL;  // NULL walks the whole chain
+pthread_once_t  blzScanOnce = PTHREAD_ONCE_INIT;
+
+ModcryptFn      modcryptCtr = NULL; // AES-NI when the CPU has it
+pthread_once_t  modcryptOnce = PTHREAD_ONCE_INIT;
 
 /*----------------------------------------------------------------------------*/
-// GBA Slot init (SDK 5)
-static const uint32_t gbaSlotInitSignature[3]         = {0xE92D4038, 0xE59F0094, 0xE5901008};
-static const uint32_t gbaSlotInitSignatureAlt[3]      = {0xE92D4038, 0xE59F4090, 0xE5940008};
-static const uint16_t gbaSlotInitSignatureThumb[3]    = {0xB538, 0x4818, 0x6881};
-static const uint16_t gbaSlotInitSignatureThumbAlt[3] = {0xB538, 0x4C18, 0x68A0};
+// ARM9 signatures, all searched for in a single pass over the binary
+typedef struct {
+	const char *name;
+	int group;                      // only the first matching entry of a group is patched
+	bool thumb;                     // halfword aligned THUMB code, else word aligned ARM
+	int count;
+	uint32_t sig[3];
+	uint32_t alt[3];                // each element may match either sig or alt
+	bool patched;                   // false: only located
+	uint32_t patch;                 // written over the first element
+	uint32_t a7mbk6;                // required ARM7 MBK6 setting, 0 for any
+} ArmSignature;
+
+#define ARM_MODULE_PARAMS 0
+
+static const ArmSignature armSignatures[] = {
+	{"module params", 0, false, 2, {0xDEC00621, 0x2106C0DE}, {0xDEC00621, 0x2106C0DE}, false, 0, 0},
+	// GBA Slot init (SDK 5)
+	{"GBA slot init", 1, false, 3, {0xE92D4038, 0xE59F0094, 0xE5901008}, {0xE92D4038, 0xE59F4090, 0xE5940008}, true, 0xE12FFF1E, 0x00403000},
+	{"GBA slot init (THUMB)", 1, true, 3, {0xB538, 0x4818, 0x6881}, {0xB538, 0x4C18, 0x68A0}, true, 0x4770, 0x00403000},
+};
+
+#define ARM_SIGNATURES (int)(sizeof(armSignatures) / sizeof(armSignatures[0]))
 
 /*----------------------------------------------------------------------------*/
 #define BREAK(text)   { printf(text); return; }
 #define EXIT(text)    { printf(text); exit(-1); }
 
 /*----------------------------------------------------------------------------*/
+// Match copy of the decoder, raw[i] = raw[i + pos] from the top down. Long
+// matches that don't overlap within a word are copied 8 bytes at a time.
+static inline void BLZ_Copy(unsigned char *raw, unsigned int pos, unsigned int len) {
+  uint64_t word;
+
+  if ((pos >= 8) && (len >= 8)) {
+    for (; len > 8; len -= 8) {
+      memcpy(&word, raw + len - 8 + pos, 8);
+      memcpy(raw + len - 8, &word, 8);
+    }
+    memcpy(&word, raw + pos, 8);
+    memcpy(raw, &word, 8);
+  } else {
+    while (len--) raw[len] = raw[len + pos];
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+bool  JobOptimize(JobPool *pool, RomJob *job);
+bool  JobInspect(RomJob *job, unsigned char *header, unsigned char *arm9, unsigned int len);
+bool  JobDonor(DonorCache *cache, RomJob *job, unsigned char *header);
+bool  JobTriage(JobPool *pool, RomJob *job);
+void  JobOverlays(JobPool *pool, RomJob *job);
+void  JobWriteBase(RomJob *job);
+void  JobWriteBasePatch(RomJob *job);
+void *JobSideStage(void *arg);
+void  JobReport(RomJob *job, int format);
+void  JobEstimate(RomJob *job);
+void  JobRanking(JobPool *pool);
+int   JobSavingCompare(const void *a, const void *b);
+
 void  Title(void);
 void  Usage(void);
+void  Log(RomJob *job, const char *format, ...);
 
 char *Load(char *filename, unsigned int source, int srcLength);
-void  Save(char *filename, char *buffer, int length);
+void  Save(char *filename, unsigned char *buffer, int length);
 char *Memory(int length, int size);
+void *ArenaAlloc(Arena *arena, size_t length);
+void *ArenaCalloc(Arena *arena, size_t length);
+ArenaMark ArenaSave(Arena *arena);
+void  ArenaRestore(Arena *arena, ArenaMark mark);
+void  ArenaReset(Arena *arena);
+void  ArenaFree(Arena *arena);
+
+bool  RomOpen(RomHandle *rom, char *filename);
+bool  RomParse(RomHandle *rom);
+void  RomClose(RomHandle *rom);
+unsigned char *RomView(RomHandle *rom, unsigned int offset, unsigned int length);
+bool  RomRebuild(RomJob *job, char *outfilename, unsigned char **buffer, unsigned int *length);
 
-void  BLZ_Decode(char *filename);
-void  BLZ_Encode(char *filename, char *outfilename, int mode);
-char *BLZ_Code(unsigned char *raw_buffer, int raw_len, int *new_len, int best);
-void  BLZ_Invert(char *buffer, int length);
+void  ArmScan(unsigned char *buffer, unsigned int length, uint32_t a7mbk6, int *found);
+int   ArmPatch(RomJob *job, unsigned char *buffer, int *found);
+
+const char *DonorCheck(Donor *donor, int major, int minor);
+int   DonorIndex(DonorCache *cache, const char *dir);
+Donor *DonorGet(DonorCache *cache, RomJob *job);
+bool  DonorSave(DonorCache *cache, char *filename, unsigned char *buffer, int length, char *saved);
+void  DonorFree(DonorCache *cache);
+
+void  AesExpand(const unsigned char *key, unsigned char *rk);
+void  AesEncrypt(const unsigned char *rk, const unsigned char *in, unsigned char *out);
+void  ModcryptInit(void);
+void  ModcryptKey(const unsigned char *header, unsigned char *rk);
+bool  ModcryptCovers(const unsigned char *header, unsigned int offset, unsigned int length);
+bool  ModcryptRegion(const unsigned char *header, unsigned char *buffer, unsigned int offset, unsigned int length);
+
+unsigned char *BLZ_Decode(unsigned char *pak_buffer, unsigned int pak_len, unsigned int *new_len, bool *safe);
+void  BLZ_Encode(RomJob *job, int mode, BLZ_Budget *budget, int threads, bool verify, char *cacheDir);
+unsigned char *BLZ_Code(unsigned char *raw_buffer, int raw_len, int *new_len, int mode, BLZ_Budget *budget,
+                        int threads, BLZ_Stats *stats, Arena *arena);
+void  BLZ_Search(BLZ_Finder *mf, unsigned char *raw_top, unsigned int cur,
+                 unsigned int raw_end, unsigned int *len_best, unsigned int *pos_best);
+void  BLZ_Matches(unsigned char *raw_top, unsigned int raw_end,
+                  unsigned char *tab_len, unsigned short *tab_pos, int threads);
+void *BLZ_MatchChunk(void *arg);
+void  BLZ_ScanInit(void);
+void  BLZ_CodeAll(BLZ_Task *tasks, int count, int threads);
+void *BLZ_CodeTask(void *arg);
+unsigned int BLZ_Optimal(unsigned char *tab_len, unsigned int raw_len, unsigned char *tok_len);
+unsigned int BLZ_Fast(unsigned char *tab_len, unsigned short *tab_pos, unsigned int raw_new, unsigned int raw_len,
+                      unsigned char *tok_len, BLZ_Budget *budget);
+unsigned int BLZ_Weigh(unsigned char *tab_len, unsigned short *tab_pos, unsigned int raw_new, unsigned int raw_len,
+                       unsigned char *tok_len, unsigned int weight, unsigned int *size, unsigned long long *cycles);
+unsigned long long BLZ_Cycles(unsigned char *pak_buffer, unsigned int pak_len);
+unsigned int BLZ_Estimate(unsigned char *raw_buffer, unsigned int raw_len, unsigned int *error);
+uint64_t BLZ_Hash(unsigned char *buffer, unsigned int length, uint64_t seed);
+unsigned char *BLZ_CacheLoad(char *dir, uint64_t key, int mode, unsigned int raw_len, unsigned int *pak_len,
+                             Arena *arena);
+void  BLZ_CacheStore(char *dir, uint64_t key, int mode, unsigned int raw_len, unsigned char *pak_buffer,
+                     unsigned int pak_len, RomJob *job);
 short BLZ_CRC16(unsigned char *buffer, unsigned int length);
 
-int filelength(const char* filename)
-{
-    FILE* fp = fopen(filename, "rb");
-    int fsize = 0;
-    if (fp) {
-        fseek(fp, 0, SEEK_END);
-        fsize = ftell(fp);			// Get source file's size
-		fseek(fp, 0, SEEK_SET);
-	}
-	fclose(fp);
+double Clock(void);
 
-	return fsize;
-}
+#if defined(TWL_BENCH) || defined(TWL_TEST)
+void  BenchCorpus(unsigned char *buffer, unsigned int length, int kind, uint32_t seed);
+#endif
+#ifdef TWL_TEST
+int   Test(void);
+void  TestCheck(bool ok, const char *name);
+unsigned char *TestRom(unsigned int *size, unsigned int arm9_len, unsigned int ovl_len, unsigned int arm7_len,
+                       bool dsi, uint32_t seed);
+void  TestDonors(void);
+void  TestShortArm9(void);
+void  TestFastOverlay(void);
+void  TestEstimate(void);
+void  TestModcrypt(void);
+#endif
+#ifdef TWL_BENCH
+int   Bench(int argc, char **argv);
+bool  BenchRun(unsigned char *raw, unsigned int raw_len, int kind, int mode, int threads, int repeat, bool csv);
+#endif
 
 /*----------------------------------------------------------------------------*/
-void arm7extract(char *filename, char *outfilename, char *outfilenamei) {
-  unsigned char *raw_buffer;
-  unsigned int   arm7src, arm7len, arm7isrc, arm7ilen;
-
-  printf("- loading header of '%s'\n", filename);
-	FILE* ndsFile = fopen(filename, "rb");
-	fseek(ndsFile, 0x30, SEEK_SET);
-	fread(&arm7src, sizeof(unsigned int), 1, ndsFile);
-	fseek(ndsFile, 0x3C, SEEK_SET);
-	fread(&arm7len, sizeof(unsigned int), 1, ndsFile);
-	fseek(ndsFile, 0x1A0, SEEK_SET);
-	fread(&a7mbk6, sizeof(unsigned int), 1, ndsFile);
-	fseek(ndsFile, 0x1D0, SEEK_SET);
-	fread(&arm7isrc, sizeof(unsigned int), 1, ndsFile);
-	fseek(ndsFile, 0x1D4, SEEK_SET);
-	fread(&deviceListAddr, sizeof(unsigned int), 1, ndsFile);
-	fseek(ndsFile, 0x1DC, SEEK_SET);
-	fread(&arm7ilen, sizeof(unsigned int), 1, ndsFile);
-	fclose(ndsFile);
+void arm7extract(RomJob *job, DonorCache *cache, char *outfilename, char *outfilenamei) {
+  Donor *donor = job->donor;
+  double start = Clock();
 
-  printf("- loading and dumping ARM7 binary\n");
-  raw_buffer = Load(filename, arm7src, arm7len);
-  Save(outfilename, raw_buffer, arm7len);
-  free(raw_buffer);
+  Log(job, "- dumping ARM7 binary\n");
+  if (DonorSave(cache, outfilename, donor->arm7, donor->arm7Len, donor->arm7Saved)) {
+    job->stats.bytesRead += donor->arm7Len;
+    job->stats.bytesWritten += donor->arm7Len;
+  }
 
-  printf("- loading and dumping ARM7i binary\n");
-  raw_buffer = Load(filename, arm7isrc, arm7ilen);
-  // TODO: Decrypt modcrypt area
-  Save(outfilenamei, raw_buffer, arm7ilen);
-  free(raw_buffer);
+  Log(job, "- dumping ARM7i binary\n");
+  // decrypted by DonorCheck when it was modcrypted
+  if (DonorSave(cache, outfilenamei, donor->arm7i, donor->arm7iLen, donor->arm7iSaved)) {
+    job->stats.bytesRead += donor->arm7iLen;
+    job->stats.bytesWritten += donor->arm7iLen;
+  }
 
-  printf("\n");
+  job->stats.saveArm7 = Clock() - start;
 }
 
 /*----------------------------------------------------------------------------*/
-int main(int argc, char **argv) {
-  int cmd, mode;
-  int arg;
+void JobInit(RomJob *job, char *romName) {
+	memset(job, 0, sizeof(RomJob));
+	job->romName = romName;
 
-  Title();
+	snprintf(job->tag, sizeof(job->tag), "%s", romName);
+	for (int i = strlen(job->tag); i > 0; i--) {
+		if (job->tag[i] == '.') {
+			job->tag[i] = 0;
+			break;
+		}
+	}
+	sprintf(job->folderName, "out/%s", job->tag);
+	mkdir(job->folderName, 0777);
+	sprintf(job->outName9, "%s/arm9.bin", job->folderName);
+	sprintf(job->outName7, "%s/arm7.bin", job->folderName);
+	sprintf(job->outName7i, "%s/arm7i.bin", job->folderName);
+	sprintf(job->outNameBase, "%s/base.nds", job->folderName);
 
-  if (argc < 2) Usage();
-  /*if      (!strcmp(argv[1], "-d"))   { cmd = CMD_DECODE; }
-  else if (!strcmp(argv[1], "-en"))  { cmd = CMD_ENCODE; mode = BLZ_NORMAL; }
-  else if (!strcmp(argv[1], "-eo"))  { cmd = CMD_ENCODE; mode = BLZ_BEST; }
-  else if (!strcmp(argv[1], "-en9")) { cmd = CMD_ENCODE; mode = BLZ_NORMAL; }
-  else if (!strcmp(argv[1], "-eo9")) { cmd = CMD_ENCODE; mode = BLZ_BEST; }
-  else                                 EXIT("Command not supported\n");
-  if (argc < 3) EXIT("Filename not specified\n");
+	char *baseName = strrchr(romName, '/');
+	sprintf(job->outNameRom, "%s/%s", job->folderName, baseName ? baseName + 1 : romName);
+}
 
-  switch (cmd) {
-    case CMD_DECODE:
-      for (arg = 2; arg < argc; arg++) BLZ_Decode(argv[arg]);
-      break;
-    case CMD_ENCODE:
-      arm9 = argv[1][3] == '9' ? 1 : 0;
-      for (arg = 2; arg < argc; arg++) BLZ_Encode(argv[arg], mode);
-      break;
-    default:
-      break;
-  }*/
+/*----------------------------------------------------------------------------*/
+unsigned int JobMemory(RomJob *job, int mode, int threads) {
+	unsigned int arm9len = job->rom.header.arm9len;
+	unsigned int memNeed;
 
-	cmd = CMD_ENCODE; mode = BLZ_NORMAL;
+	// the optimal parse, priced differently
+	if (mode & BLZ_FAST) mode = BLZ_OPTIMAL;
+	// ARM9 copy, pak buffer and final stream, match finder
+	memNeed = arm9len * 3 + arm9len / 8 + 0x48000;
+	// match table and a match finder per thread, token lengths
+	// every variant at once, both split policies of each mode
+	if (mode == BLZ_EXHAUSTIVE) {
+		return 2 * (JobMemory(job, BLZ_NORMAL, threads) + JobMemory(job, BLZ_BEST, threads)
+		          + JobMemory(job, BLZ_OPTIMAL, threads));
+	}
+	// nothing compressed, the ARM7 side is views into the donor
+	if (job->arm9Compressed) memNeed = 0;
+	if (mode == BLZ_OPTIMAL || threads > 1) memNeed += arm9len * 3 + threads * 0x48000;
+	if (mode == BLZ_OPTIMAL) memNeed += arm9len;
+	// ROM read into memory where it can't be mapped
+	if (!job->rom.mapped) memNeed += job->rom.size;
 
-	mkdir("out", 0777);
+	return memNeed;
+}
 
-	char filenamenoext[128];
-	char folderName[256];
-	char outName9[256];
-	char outName7[256];
-	char outName7i[256];
-	char outNameBase[256];
+/*----------------------------------------------------------------------------*/
+// base.nds is the ROM with only 0x1A0 and 0x1D4 of its header changed. The
+// ROM file is cloned or copied inside the kernel where that's possible, and
+// just those two words are written over it.
+void JobWriteBase(RomJob *job) {
+	unsigned int patch[2][2] = {{0x1A0, job->a7mbk6}, {0x1D4, job->deviceListAddr}};
 
-	char donorNdsName[256];
+	Log(job, "- Copying to new base.nds file\n");
 
-	for (arg = 1; arg < argc; arg++) {
-		sprintf(filenamenoext, argv[arg]);
-		for (int i = strlen(filenamenoext); i > 0; i--) {
-			if (filenamenoext[i] == '.') {
-				filenamenoext[i] = 0;
-				break;
-			}
+#ifndef _WIN32
+	int in = open(job->romName, O_RDONLY);
+	int out = open(job->outNameBase, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	bool copied = false;
+	if (in >= 0 && out >= 0) {
+		off_t left = job->rom.size;
+		ssize_t done;
+		// each way carries on from where the one before it stopped
+#ifdef __linux__
+#ifdef FICLONE
+		if (!ioctl(out, FICLONE, in)) left = 0;
+#endif
+		while (left > 0 && (done = copy_file_range(in, NULL, out, NULL, left, 0)) > 0) left -= done;
+		while (left > 0 && (done = sendfile(out, in, NULL, left)) > 0) left -= done;
+#endif
+		while (left > 0 && (done = write(out, job->rom.data + job->rom.size - left, left)) > 0) left -= done;
+		copied = !left;
+		for (int i = 0; copied && i < 2; i++) {
+			copied = pwrite(out, &patch[i][1], 4, patch[i][0]) == 4;
 		}
-		sprintf(folderName, "out/%s", filenamenoext);
-		mkdir(folderName, 0777);
-		sprintf(outName9, "%s/arm9.bin", folderName);
-		sprintf(outName7, "%s/arm7.bin", folderName);
-		sprintf(outName7i, "%s/arm7i.bin", folderName);
-		sprintf(outNameBase, "%s/base.nds", folderName);
-
-		BLZ_Encode(argv[arg], outName9, mode);
-		if (!moduleParamsFound) {
-			continue;
+	}
+	if (in >= 0) close(in);
+	if (out >= 0 && close(out)) copied = false;
+	if (!copied) EXIT("\nFile write error\n");
+#else
+	FILE* outputFile = fopen(job->outNameBase, "wb");
+	if (outputFile) {
+		unsigned char header[0x200];
+		memcpy(header, job->rom.data, 0x200);
+		for (int i = 0; i < 2; i++) *(unsigned int*)(header + patch[i][0]) = patch[i][1];
+		if (fwrite(header, 1, 0x200, outputFile) != 0x200
+		 || fwrite(job->rom.data + 0x200, 1, job->rom.size - 0x200, outputFile) != job->rom.size - 0x200) {
+			EXIT("\nFile write error\n");
 		}
+		fclose(outputFile);
+	}
+#endif
+	job->stats.bytesRead += job->rom.size;
+	job->stats.bytesWritten += job->rom.size;
+}
 
-		sprintf(donorNdsName, "a7donors/dsiware/sdk%i%i.nds", sdkVer[0], sdkVer[1]);
-		FILE* donorNdsFile = fopen(donorNdsName, "rb");
-		if (!donorNdsFile && sdkVer[1] > 0) {
-			for (int i = sdkVer[1]; i >= 0; i--) {
-				sprintf(donorNdsName, "a7donors/dsiware/sdk%i%i.nds", sdkVer[0], i);
-				donorNdsFile = fopen(donorNdsName, "rb");
-				if (donorNdsFile) {
-					break;
-				}
-			}
-		}
+/*----------------------------------------------------------------------------*/
+// The same change as an IPS patch for the original ROM, instead of a copy
+void JobWriteBasePatch(RomJob *job) {
+	unsigned int patch[2][2] = {{0x1A0, job->a7mbk6}, {0x1D4, job->deviceListAddr}};
+	unsigned char record[9];
+	char name[300];
+	FILE *fp;
 
-		if (donorNdsFile) {
-			fclose(donorNdsFile);
-			arm7extract(donorNdsName, outName7, outName7i);
-		}
+	sprintf(name, "%s/base.ips", job->folderName);
+	Log(job, "- writing base.ips\n");
+	if ((fp = fopen(name, "wb")) == NULL) EXIT("\nFile create error\n");
+	fwrite("PATCH", 1, 5, fp);
+	for (int i = 0; i < 2; i++) {
+		record[0] = patch[i][0] >> 16;
+		record[1] = patch[i][0] >> 8;
+		record[2] = patch[i][0];
+		record[3] = 0;
+		record[4] = 4;
+		memcpy(record + 5, &patch[i][1], 4);
+		if (fwrite(record, 1, 9, fp) != 9) EXIT("\nFile write error\n");
+	}
+	fwrite("EOF", 1, 3, fp);
+	if (fclose(fp) == EOF) EXIT("\nFile close error\n");
+	job->stats.bytesWritten += 5 + 2 * 9 + 3;
+}
 
-		unsigned char* copyBuf = Memory(0x100000, 1);
-
-		int romSize = filelength(argv[arg]);
-		FILE* sourceFile = fopen(argv[arg], "rb");
-		FILE* outputFile = fopen(outNameBase, "wb");
-		if (outputFile) {
-			printf("- Copying to new base.nds file\n");
-			int offset = 0;
-			int numr;
-			bool modified = false;
-			while (1) {
-				// Copy file to destination path
-				numr = fread(copyBuf, 1, 0x100000, sourceFile);
-				if (!modified) {
-					*(unsigned int*)(copyBuf + 0x1A0) = a7mbk6;
-					*(unsigned int*)(copyBuf + 0x1D4) = deviceListAddr;
-					modified = true;
-				}
-				fwrite(copyBuf, 1, numr, outputFile);
-				offset += 0x100000;
-
-				if (offset > romSize) {
-					fclose(sourceFile);
-					fclose(outputFile);
-					break;
-				}
-			}
+/*----------------------------------------------------------------------------*/
+// Everything done to a ROM in memory: the ARM9 compressed and patched, the
+// overlays, the donor's ARM7 side. Results are left in the job for
+// RomRebuild, in its arena. Returns false when there's nothing to rebuild.
+bool JobOptimize(JobPool *pool, RomJob *job) {
+	if (!job->arm9Compressed) {
+		BLZ_Encode(job, pool->mode, &pool->budget, pool->blzThreads, pool->verify, pool->cacheDir);
+		if (!job->moduleParamsFound) {
+			return false;
 		}
-
-		free(copyBuf);
 	}
 
-  printf("\nDone\n");
+	if (pool->overlays) JobOverlays(pool, job);
 
-  return(0);
-}
+	// the donor was looked up by JobDonor
+	if (job->donor != NULL) {
+		Donor *donor = job->donor;
+		Log(job, "- using donor '%s'%s\n", donor->name, job->cameraWifi ? ", the ROM uses the camera or wireless" : "");
+		job->a7mbk6 = donor->rom.header.a7mbk6;
+		job->deviceListAddr = donor->rom.header.deviceListAddr;
+		job->arm7 = donor->arm7;
+		job->arm7Len = donor->arm7Len;
+		job->arm7i = donor->arm7i;
+		job->arm7iLen = donor->arm7iLen;
+	}
 
-/*----------------------------------------------------------------------------*/
-void Title(void) {
-  printf(
-    "\n"
-    "TWL-ROM-Optimize - Rocket Robz 2022\n"
-    "BLZ compression code from BLZ - (c) CUE 2011\n"
-    "\n"
-  ); 
+	return true;
 }
 
 /*----------------------------------------------------------------------------*/
-void Usage(void) {
-  EXIT(
-    "Usage: TWL-ROM-Optimize romfilename [romfilename [...]]\n"
-    "\n"
-    "When running, new small ARM binaries will be in \"out/romfolder/\".\n"
-    "Use TinkeDSi to replace the existing files in the ftc folder in the base.nds file.\n"
-  );
-}
+// The outputs that don't need the compressed ARM9: the donor's ARM7 side and
+// base.nds, which only takes the donor's header words. Run on a copy of the
+// job, so that its counters and those words are its own.
+typedef struct {
+	JobPool *pool;
+	RomJob job;
+} JobSide;
 
-/*----------------------------------------------------------------------------*/
-char *Load(char *filename, unsigned int source, int srcLength) {
-  FILE *fp;
-  char *fb;
+void *JobSideStage(void *arg) {
+	JobSide *side = (JobSide *)arg;
+	RomJob *job = &side->job;
+	double start;
 
-  if ((fp = fopen(filename, "rb")) == NULL) EXIT("\nFile open error\n");
-  fseek(fp, source, SEEK_SET);
-  fb = Memory(srcLength, sizeof(char));
-  if (fread(fb, 1, srcLength, fp) != srcLength) EXIT("\nFile read error\n");
-  if (fclose(fp) == EOF) EXIT("\nFile close error\n");
+	if (job->donor != NULL) arm7extract(job, &side->pool->donors, job->outName7, job->outName7i);
 
-  return(fb);
+	if (side->pool->writeBase) {
+		start = Clock();
+		if (side->pool->basePatch) JobWriteBasePatch(job);
+		else                       JobWriteBase(job);
+		job->stats.base = Clock() - start;
+	}
+
+	return NULL;
 }
 
 /*----------------------------------------------------------------------------*/
-void Save(char *filename, char *buffer, int length) {
-  FILE *fp;
+// A ROM's work after triage, as two branches that the rebuild waits for:
+// the ARM9 compressed (and the overlays) then saved, and JobSideStage. The
+// second one runs on its own thread while the first compresses.
+void JobProcess(JobPool *pool, RomJob *job) {
+	JobSide side;
+	pthread_t thread;
+	bool split;
+	double start;
 
-  if ((fp = fopen(filename, "wb")) == NULL) EXIT("\nFile create error\n");
-  if (fwrite(buffer, 1, length, fp) != length) EXIT("\nFile write error\n");
-  if (fclose(fp) == EOF) EXIT("\nFile close error\n");
-}
+	memset(&side, 0, sizeof(JobSide));
+	side.pool = pool;
+	side.job = *job;
+	memset(&side.job.stats, 0, sizeof(JobStats));
+	if (job->donor != NULL) {
+		side.job.a7mbk6 = job->donor->rom.header.a7mbk6;
+		side.job.deviceListAddr = job->donor->rom.header.deviceListAddr;
+	}
 
-/*----------------------------------------------------------------------------*/
-char *Memory(int length, int size) {
-  char *fb;
+	// nothing to overlap when the ARM9 stays as it is
+	split = !job->arm9Compressed && (job->donor != NULL || pool->writeBase)
+	     && !pthread_create(&thread, NULL, JobSideStage, &side);
 
-  fb = (char *) calloc(length, size);
-  if (fb == NULL) EXIT("\nMemory error\n");
+	bool optimized = JobOptimize(pool, job);
 
-  return(fb);
+	if (optimized && job->arm9 != NULL) {
+		start = Clock();
+		Save(job->outName9, job->arm9, job->arm9Len);
+		job->stats.bytesWritten += job->arm9Len;
+		job->stats.saveArm9 = Clock() - start;
+	}
+
+	if (split) pthread_join(thread, NULL);
+	else if (optimized) JobSideStage(&side);
+	if (!optimized) return;
+
+	job->stats.saveArm7 = side.job.stats.saveArm7;
+	job->stats.base = side.job.stats.base;
+	job->stats.bytesRead += side.job.stats.bytesRead;
+	job->stats.bytesWritten += side.job.stats.bytesWritten;
+
+	Log(job, "- writing optimized ROM\n");
+	start = Clock();
+	bool rebuilt = RomRebuild(job, job->outNameRom, NULL, NULL);
+	job->stats.rebuild = Clock() - start;
+	if (!rebuilt) {
+		Log(job, "- ROM layout not understood, use base.nds with TinkeDSi instead\n");
+		if (!pool->writeBase) {
+			start = Clock();
+			if (pool->basePatch) JobWriteBasePatch(job);
+			else                 JobWriteBase(job);
+			job->stats.base = Clock() - start;
+		}
+	}
+
+	// all in the worker's arena, given back as a whole
+	job->arm9 = NULL;
+	job->ovt = NULL;
+	job->fileData = NULL;
+	job->fileLen = NULL;
+
+	Log(job, "- done\n");
 }
 
 /*----------------------------------------------------------------------------*/
-/*void BLZ_Decode(char *filename) {
-  unsigned char *pak_buffer, *raw_buffer, *pak, *raw, *pak_end, *raw_end;
-  unsigned int   pak_len, raw_len, len, pos, inc_len, hdr_len, enc_len, dec_len;
-  unsigned char  flags, mask;
+// Sorts a ROM out from its header and the start of its ARM9 binary, where the
+// module params are, before anything else of it is read. ROMs with neither an
+// ARM9 binary to compress nor a donor for their ARM7 side are skipped.
+bool JobTriage(JobPool *pool, RomJob *job) {
+	unsigned char header[0x200], arm9[ARM9_PARAMS + 8];
+	unsigned int arm9len, len;
+	double start = Clock();
+	FILE *fp;
 
-  printf("- decoding '%s'", filename);
+	if ((fp = fopen(job->romName, "rb")) == NULL) {
+		Log(job, "- skipped, could not open '%s'\n", job->romName);
+		return false;
+	}
+	len = 0;
+	if (fread(header, 1, sizeof(header), fp) == sizeof(header)) {
+		arm9len = *(unsigned int *)(header + 0x2C);
+		len = arm9len < sizeof(arm9) ? arm9len : sizeof(arm9);
+		if (fseek(fp, *(unsigned int *)(header + 0x20), SEEK_SET) || fread(arm9, 1, len, fp) != len) len = 0;
+	}
+	fclose(fp);
+	job->stats.bytesRead += sizeof(header) + len;
+	if (!len) {
+		Log(job, "- skipped, not a ROM or its ARM9 binary is out of it\n");
+		return false;
+	}
 
-  pak_buffer = Load(filename, &pak_len, BLZ_MINIM, BLZ_MAXIM);
+	if (!JobInspect(job, header, arm9, len)) return false;
+	job->stats.triage = Clock() - start;
 
-  inc_len = *(unsigned int *)(pak_buffer + pak_len - 4);
-  if (!inc_len) {
-    printf(", WARNING: not coded file!");
-    enc_len = 0;
-    dec_len = pak_len;
-    pak_len = 0;
-    raw_len = dec_len;
-  } else {
-    if (pak_len < 8) EXIT("\nFile has a bad header\n");
-    hdr_len = pak_buffer[pak_len - 5];
-    if ((hdr_len < 0x08) || (hdr_len > 0x0B)) EXIT("\nBad header length\n");
-    if (pak_len <= hdr_len) EXIT("\nBad length\n");
-    enc_len = *(unsigned int *)(pak_buffer + pak_len - 8) & 0x00FFFFFF;
-    dec_len = pak_len - enc_len;
-    pak_len = enc_len - hdr_len;
-    raw_len = dec_len + enc_len + inc_len;
-    if (raw_len > RAW_MAXIM) EXIT("\nBad decoded length\n");
-  }
+	start = Clock();
+	bool queued = JobDonor(&pool->donors, job, header);
+	job->stats.donor = Clock() - start;
 
-  raw_buffer = (unsigned char *) Memory(raw_len, sizeof(char));
+	return queued;
+}
 
-  pak = pak_buffer;
-  raw = raw_buffer;
-  pak_end = pak_buffer + dec_len + pak_len;
-  raw_end = raw_buffer + raw_len;
+/*----------------------------------------------------------------------------*/
+// What the triage reads from a ROM header and the first 'len' bytes of its
+// ARM9 binary
+bool JobInspect(RomJob *job, unsigned char *header, unsigned char *arm9, unsigned int len) {
+	int found[ARM_SIGNATURES];
 
-  for (len = 0; len < dec_len; len++) *raw++ = *pak++;
+	// module params only, the other signatures need the ARM7 MBK6 setting
+	ArmScan(arm9, len, 0, found);
+	if (found[ARM_MODULE_PARAMS] < 8 || found[ARM_MODULE_PARAMS] >= ARM9_PARAMS) {
+		Log(job, "- skipped, no module params\n");
+		return false;
+	}
+	job->moduleParamsFound = true;
+	job->sdkVer[0] = arm9[found[ARM_MODULE_PARAMS] - 1];
+	job->sdkVer[1] = arm9[found[ARM_MODULE_PARAMS] - 2];
+	job->arm9Compressed = *(unsigned int *)(arm9 + found[ARM_MODULE_PARAMS] - 8) != 0;
+	job->a7mbk6 = *(unsigned int *)(header + 0x1A0);
+	job->deviceListAddr = *(unsigned int *)(header + 0x1D4);
+	job->cameraWifi = (header[0x12] & 2)
+	               && ((header[0x1BF] & DSI_WIRELESS) || (*(unsigned int *)(header + 0x1B4) & DSI_CAMERA));
 
-  BLZ_Invert(pak_buffer + dec_len, pak_len);
+	return true;
+}
 
-  mask = 0;
+/*----------------------------------------------------------------------------*/
+// Picks the donor for an inspected ROM. Returns false when that leaves it
+// nothing to do.
+bool JobDonor(DonorCache *cache, RomJob *job, unsigned char *header) {
+	// an NTR ROM has no ARM7i, nor the header fields a donor's goes with
+	job->donor = header[0x12] & 2 ? DonorGet(cache, job) : NULL;
+	// a donor bigger than what the ROM has would only make it grow
+	if (job->donor != NULL
+	 && job->donor->arm7Len + job->donor->arm7iLen >= *(unsigned int *)(header + 0x3C) + *(unsigned int *)(header + 0x1DC)) {
+		Log(job, "- ARM7 binaries already smaller than the donor's\n");
+		job->donor = NULL;
+	}
 
-  while (raw < raw_end) {
-    if (!(mask >>= BLZ_SHIFT)) {
-      if (pak == pak_end) break;
-      flags = *pak++;
-      mask = BLZ_MASK;
-    }
+	if (job->donor == NULL) {
+		if (job->arm9Compressed) {
+			Log(job, "- skipped, ARM9 binary already compressed and no donor for SDK %i.%i\n", job->sdkVer[0], job->sdkVer[1]);
+			return false;
+		}
+		if (!(header[0x12] & 2))              Log(job, "- not a DSi ROM, only the ARM9 binary will be compressed\n");
+		else if (job->sdkVer[0] != DONOR_SDK) Log(job, "- unknown SDK %i.%i, only the ARM9 binary will be compressed\n", job->sdkVer[0], job->sdkVer[1]);
+		else                                  Log(job, "- no %sdonor for SDK %i.%i, only the ARM9 binary will be compressed\n",
+		                                          job->cameraWifi ? "camerawifi " : "", job->sdkVer[0], job->sdkVer[1]);
+	} else if (job->arm9Compressed) {
+		Log(job, "- ARM9 binary already compressed, only the ARM7 binaries will be replaced\n");
+	}
 
-    if (!(flags & mask)) {
-      if (pak == pak_end) break;
-      *raw++ = *pak++;
-    } else {
-      if (pak + 1 >= pak_end) break;
-      pos = *pak++ << 8;
-      pos |= *pak++;
-      len = (pos >> 12) + BLZ_THRESHOLD + 1;
-      if (raw + len > raw_end) {
-        printf(", WARNING: wrong decoded length!");
-        len = raw_end - raw;
-      }
-      pos = (pos & 0xFFF) + 3;
-      while (len--) *raw++ = *(raw - pos);
-    }
-  }
+	return true;
+}
+
+/*----------------------------------------------------------------------------*/
+// BLZ-compresses the ARM9 overlays the table lists as uncompressed, all at
+// once on the compression threads. The SDK loader unpacks an overlay in place
+// when its table entry has the compressed flag and size, so only the table
+// copy and the files change; they are used by RomRebuild.
+void JobOverlays(JobPool *pool, RomJob *job) {
+	RomHandle *rom = &job->rom;
+	unsigned char *ovt, *fat, *entry;
+	unsigned int ovtLen, fatCount, fileId, off, len, count, oldLen, newLen, i, n;
+	BLZ_Task *tasks;
+	unsigned int *ids;
 
-  BLZ_Invert(raw_buffer + dec_len, raw_len - dec_len);
+	ovtLen = *(unsigned int *)(rom->data + 0x54);
+	ovt = RomView(rom, *(unsigned int *)(rom->data + 0x50), ovtLen);
+	fatCount = *(unsigned int *)(rom->data + 0x4C) / 8;
+	fat = RomView(rom, *(unsigned int *)(rom->data + 0x48), fatCount * 8);
+	if (ovt == NULL || fat == NULL || !ovtLen) return;
 
-  raw_len = raw - raw_buffer;
+	count = ovtLen / OVT_ENTRY;
+	tasks = (BLZ_Task *) ArenaAlloc(job->arena, count * sizeof(BLZ_Task));
+	ids = (unsigned int *) ArenaAlloc(job->arena, count * sizeof(unsigned int));
 
-  if (raw != raw_end) printf(", WARNING: unexpected end of encoded file!");
+	for (i = n = 0; i < count; i++) {
+		entry = ovt + i * OVT_ENTRY;
+		fileId = *(unsigned int *)(entry + 0x18);
+		// already compressed, or checked against a digest that would no longer match
+		if (entry[0x1F] & (OVT_COMPRESSED | OVT_DIGEST)) continue;
+		if (fileId >= fatCount) continue;
+		off = *(unsigned int *)(fat + fileId * 8);
+		len = *(unsigned int *)(fat + fileId * 8 + 4) - off;
+		if (len < 0x100 || len > *(unsigned int *)(entry + 0x08) || RomView(rom, off, len) == NULL) continue;
 
-  Save(filename, raw_buffer, raw_len);
+		tasks[n].raw_buffer = rom->data + off;
+		tasks[n].raw_len = len;
+		tasks[n].mode = pool->mode | BLZ_NOHEAD;
+		tasks[n].budget = &pool->budget;
+		tasks[n].threads = 1;
+		tasks[n].stats = NULL;
+		ids[n++] = i;
+	}
 
-  free(raw_buffer);
-  free(pak_buffer);
+	if (n) {
+		Log(job, "- compressing %i ARM9 overlays\n", n);
+		BLZ_CodeAll(tasks, n, pool->blzThreads);
 
-  printf("\n");
-}*/
+		job->ovt = (unsigned char *) ArenaAlloc(job->arena, ovtLen);
+		memcpy(job->ovt, ovt, ovtLen);
+		job->fileData = (unsigned char **) ArenaCalloc(job->arena, fatCount * sizeof(unsigned char *));
+		job->fileLen = (unsigned int *) ArenaCalloc(job->arena, fatCount * sizeof(unsigned int));
 
-/*----------------------------------------------------------------------------*/
-void BLZ_Encode(char *filename, char *outfilename, int mode) {
-  unsigned char *raw_buffer, *pak_buffer, *new_buffer;
-  unsigned int   raw_len, pak_len, new_len;
-
-  printf("- loading header of '%s'\n", filename);
-	unsigned int arm9src = 0;
-	unsigned int arm9dst = 0;
-	FILE* ndsFile = fopen(filename, "rb");
-	fseek(ndsFile, 0xC, SEEK_SET);
-	fread(titleID, 1, 3, ndsFile);
-	fseek(ndsFile, 0x20, SEEK_SET);
-	fread(&arm9src, sizeof(unsigned int), 1, ndsFile);
-	fseek(ndsFile, 0x28, SEEK_SET);
-	fread(&arm9dst, sizeof(unsigned int), 1, ndsFile);
-	fseek(ndsFile, 0x2C, SEEK_SET);
-	fread(&raw_len, sizeof(unsigned int), 1, ndsFile);
-	fseek(ndsFile, 0x1A0, SEEK_SET);
-	fread(&a7mbk6, sizeof(unsigned int), 1, ndsFile);
-	fclose(ndsFile);
-
-  printf("- loading ARM9 binary\n");
-  raw_buffer = Load(filename, arm9src, raw_len);
-
-  printf("- searching module params...");
-	moduleParamsFound = false;
-	unsigned int moduleParamsOffset = 0;
-	for (moduleParamsOffset = 0; moduleParamsOffset < raw_len; moduleParamsOffset += 4) {
-		if (*(unsigned int*)(raw_buffer + moduleParamsOffset) == 0xDEC00621 && *(unsigned int*)(raw_buffer + moduleParamsOffset + 4) == 0x2106C0DE) {
-			printf(" found\n");
-			moduleParamsFound = true;
-			sdkVer[0] = *(char*)(raw_buffer + moduleParamsOffset - 1); // SDK version
-			sdkVer[1] = *(char*)(raw_buffer + moduleParamsOffset - 2); // SDK sub-version
-			if (*(unsigned int*)(raw_buffer + moduleParamsOffset - 8) != 0) {
-				printf("- ARM9 binary already compressed\n");
-				free(raw_buffer);
-				return;
+		oldLen = newLen = 0;
+		for (i = 0; i < n; i++) {
+			unsigned char *dec;
+			unsigned int dec_len;
+			bool ok, safe;
+
+			entry = job->ovt + ids[i] * OVT_ENTRY;
+			fileId = *(unsigned int *)(entry + 0x18);
+			len = tasks[i].raw_len;
+
+			// only real savings, as BLZ output; a stored copy is left as it was
+			ok = tasks[i].pak_len >= 4 && (unsigned int)tasks[i].pak_len < len
+			  && *(unsigned int *)(tasks[i].pak_buffer + tasks[i].pak_len - 4);
+			if (ok && pool->verify) {
+				dec = BLZ_Decode(tasks[i].pak_buffer, tasks[i].pak_len, &dec_len, &safe);
+				ok = dec != NULL && safe && dec_len == len && !memcmp(dec, tasks[i].raw_buffer, len);
+				if (dec != NULL) free(dec);
+				if (!ok) Log(job, "- verifying overlay %u... failed, keeping it uncompressed\n", ids[i]);
 			}
-			break;
+			if (!ok || job->fileData[fileId] != NULL) {
+				free(tasks[i].pak_buffer);
+				continue;
+			}
+			// coded on other threads, so moved into the arena here
+			job->fileData[fileId] = (unsigned char *) ArenaAlloc(job->arena, tasks[i].pak_len);
+			memcpy(job->fileData[fileId], tasks[i].pak_buffer, tasks[i].pak_len);
+			job->fileLen[fileId] = tasks[i].pak_len;
+			free(tasks[i].pak_buffer);
+			*(unsigned int *)(entry + 0x1C) = tasks[i].pak_len | (entry[0x1F] | OVT_COMPRESSED) << 24;
+			oldLen += len;
+			newLen += tasks[i].pak_len;
+			job->stats.overlayCycles += BLZ_Cycles(job->fileData[fileId], job->fileLen[fileId]);
 		}
+		Log(job, "- overlays: %u -> %u bytes, about %.2f ms to decode\n", oldLen, newLen,
+		    job->stats.overlayCycles * 1000.0 / CYC_ARM9_HZ);
 	}
+}
 
-	if (!moduleParamsFound) {
-		printf(" not found\n");
-		free(raw_buffer);
-		return;
-	} else if (moduleParamsOffset >= 0x3000) {
-		printf("- module params offset is invalid\n");
-		free(raw_buffer);
+/*----------------------------------------------------------------------------*/
+// Writes the job's timings and counters to report.json or report.csv in its
+// output folder
+void JobReport(RomJob *job, int format) {
+	static const char *fields[] = {
+		"rom", "open", "triage", "load", "scan", "compress", "verify", "save_arm9", "donor", "save_arm7",
+		"base", "rebuild", "total", "bytes_read", "bytes_written", "arm9_len", "arm9_pak_len",
+		"decode_cycles", "overlay_decode_cycles",
+		"blz_table", "blz_parse", "blz_encode", "searched", "matches", "match_bytes",
+		"literals", "literal_ratio", "arena_peak", "cache_hit"
+	};
+	JobStats *stats = &job->stats;
+	const int count = sizeof(fields) / sizeof(fields[0]);
+	char name[300], values[sizeof(fields) / sizeof(fields[0])][300], *out;
+	unsigned long long coded = stats->blz.literals + stats->blz.matchBytes;
+	int i, v = 1;
+
+	// the ROM name, quoted and escaped for either format
+	out = values[0];
+	*out++ = '"';
+	for (i = 0; job->tag[i]; i++) {
+		if (job->tag[i] == '"') *out++ = format == REPORT_CSV ? '"' : '\\';
+		else if (job->tag[i] == '\\' && format == REPORT_JSON) *out++ = '\\';
+		*out++ = job->tag[i];
+	}
+	*out++ = '"';
+	*out = 0;
+	sprintf(values[v++], "%.6f", stats->open);
+	sprintf(values[v++], "%.6f", stats->triage);
+	sprintf(values[v++], "%.6f", stats->load);
+	sprintf(values[v++], "%.6f", stats->scan);
+	sprintf(values[v++], "%.6f", stats->compress);
+	sprintf(values[v++], "%.6f", stats->verify);
+	sprintf(values[v++], "%.6f", stats->saveArm9);
+	sprintf(values[v++], "%.6f", stats->donor);
+	sprintf(values[v++], "%.6f", stats->saveArm7);
+	sprintf(values[v++], "%.6f", stats->base);
+	sprintf(values[v++], "%.6f", stats->rebuild);
+	sprintf(values[v++], "%.6f", stats->total);
+	sprintf(values[v++], "%llu", stats->bytesRead);
+	sprintf(values[v++], "%llu", stats->bytesWritten);
+	sprintf(values[v++], "%u", job->rom.header.arm9len);
+	sprintf(values[v++], "%u", job->arm9Len);
+	sprintf(values[v++], "%llu", stats->decodeCycles);
+	sprintf(values[v++], "%llu", stats->overlayCycles);
+	sprintf(values[v++], "%.6f", stats->blz.table);
+	sprintf(values[v++], "%.6f", stats->blz.parse);
+	sprintf(values[v++], "%.6f", stats->blz.encode);
+	sprintf(values[v++], "%llu", stats->blz.searched);
+	sprintf(values[v++], "%llu", stats->blz.matches);
+	sprintf(values[v++], "%llu", stats->blz.matchBytes);
+	sprintf(values[v++], "%llu", stats->blz.literals);
+	sprintf(values[v++], "%.4f", coded ? (double)stats->blz.literals / coded : 0.0);
+	sprintf(values[v++], "%llu", stats->arenaPeak);
+	sprintf(values[v++], "%s", stats->cacheHit ? "true" : "false");
+
+	sprintf(name, "%s/report.%s", job->folderName, format == REPORT_CSV ? "csv" : "json");
+	FILE *fp = fopen(name, "w");
+	if (fp == NULL) {
+		Log(job, "- could not write '%s'\n", name);
 		return;
 	}
 
-	if (a7mbk6 == 0x00403000) {
-		bool found = false;
-		for (int i = 0; i < raw_len; i += 4) {
-			if ((*(uint32_t*)(raw_buffer + i)     == gbaSlotInitSignature[0] || *(uint32_t*)(raw_buffer + i)     == gbaSlotInitSignatureAlt[0])
-			 && (*(uint32_t*)(raw_buffer + i + 4) == gbaSlotInitSignature[1] || *(uint32_t*)(raw_buffer + i + 4) == gbaSlotInitSignatureAlt[1])
-			 && (*(uint32_t*)(raw_buffer + i + 8) == gbaSlotInitSignature[2] || *(uint32_t*)(raw_buffer + i + 8) == gbaSlotInitSignatureAlt[2]))
-			{
-				*(uint32_t*)(raw_buffer + i) = 0xE12FFF1E;
-				found = true;
-				break;
-			}
+	if (format == REPORT_CSV) {
+		for (i = 0; i < count; i++) fprintf(fp, "%s%s", fields[i], i < count - 1 ? "," : "\n");
+		for (i = 0; i < count; i++) fprintf(fp, "%s%s", values[i], i < count - 1 ? "," : "\n");
+	} else {
+		fprintf(fp, "{\n");
+		for (i = 0; i < count; i++) {
+			fprintf(fp, "  \"%s\": %s%s\n", fields[i], values[i], i < count - 1 ? "," : "");
 		}
-		if (!found) {
-			for (int i = 0; i < raw_len; i += 2) {
-				if ((*(uint16_t*)(raw_buffer + i)     == gbaSlotInitSignatureThumb[0] || *(uint16_t*)(raw_buffer + i)     == gbaSlotInitSignatureThumbAlt[0])
-				 && (*(uint16_t*)(raw_buffer + i + 2) == gbaSlotInitSignatureThumb[1] || *(uint16_t*)(raw_buffer + i + 2) == gbaSlotInitSignatureThumbAlt[1])
-				 && (*(uint16_t*)(raw_buffer + i + 4) == gbaSlotInitSignatureThumb[2] || *(uint16_t*)(raw_buffer + i + 4) == gbaSlotInitSignatureThumbAlt[2]))
-				{
-					*(uint16_t*)(raw_buffer + i) = 0x4770;
-					found = true;
-					break;
-				}
-			}
+		fprintf(fp, "}\n");
+	}
+	fclose(fp);
+}
+
+/*----------------------------------------------------------------------------*/
+// --estimate: what optimizing the ROM would save. The ARM9 binary's size
+// comes from BLZ_Estimate, the donor's ARM7 side is known, and the rebuilt
+// ROM is laid out with them (its TWL region starts at a 512KB unit).
+void JobEstimate(RomJob *job) {
+	NdsHeader *header = &job->rom.header;
+	unsigned char *arm9 = NULL;
+	unsigned int pak = header->arm9len, error = 0, size[3];
+	long long arm7 = 0;
+	double start = Clock();
+
+	if (!job->arm9Compressed) {
+		arm9 = RomView(&job->rom, header->arm9src, header->arm9len);
+		if (arm9 == NULL) {
+			Log(job, "- ARM9 binary is out of the ROM\n");
+			return;
 		}
+		pak = BLZ_Estimate(arm9, header->arm9len, &error);
+		// left as it is when it wouldn't get smaller
+		if (pak >= header->arm9len) pak = header->arm9len;
+		if (error > pak) error = pak;
+		job->stats.bytesRead += header->arm9len;
+	}
+	if (job->donor != NULL) {
+		arm7 = (long long)header->arm7len + header->arm7ilen - job->donor->arm7Len - job->donor->arm7iLen;
+		job->arm7 = job->donor->arm7;
+		job->arm7Len = job->donor->arm7Len;
+		job->arm7i = job->donor->arm7i;
+		job->arm7iLen = job->donor->arm7iLen;
 	}
+	job->stats.compress = Clock() - start;
 
-  printf("- compressing ARM9 binary", filename);
+	// the expected size and both ends of its error, only the layout of each
+	job->arm9 = arm9;
+	bool laid = true;
+	for (int i = 0; i < 3; i++) {
+		job->arm9Len = i == 1 ? pak - error : i == 2 ? pak + error : pak;
+		if (job->arm9Len > header->arm9len) job->arm9Len = header->arm9len;
+		laid = laid && RomRebuild(job, NULL, NULL, &size[i]);
+	}
+	job->arm9 = job->arm7 = job->arm7i = NULL;
 
-  pak_buffer = NULL;
-  pak_len = BLZ_MAXIM + 1;
+	if (laid) {
+		job->saving = (long long)job->rom.size - size[0];
+		job->savingError = size[2] - size[0] > size[0] - size[1] ? size[2] - size[0] : size[0] - size[1];
+	} else {
+		Log(job, "- ROM layout not understood, only the binaries are counted\n");
+		job->saving = (long long)header->arm9len - pak + arm7;
+		job->savingError = error;
+	}
+	job->romSize = job->rom.size;
+	job->estimated = true;
+	Log(job, "- about %.2fMB -> %.2fMB (+/- %.2fMB), ARM9 %u -> %u bytes, ARM7 side %lld bytes smaller\n",
+	    job->romSize / 1048576.0, (job->romSize - job->saving) / 1048576.0, job->savingError / 1048576.0,
+	    header->arm9len, pak, arm7);
+}
 
-  new_buffer = BLZ_Code(raw_buffer, raw_len, &new_len, mode);
-  if (new_len < pak_len) {
-    if (pak_buffer != NULL) free(pak_buffer);
-    pak_buffer = new_buffer;
-    pak_len = new_len;
-  }
+/*----------------------------------------------------------------------------*/
+// The estimated ROMs by what they would save, most first, and the total
+int JobSavingCompare(const void *a, const void *b) {
+	RomJob *x = *(RomJob **)a, *y = *(RomJob **)b;
 
-	*(unsigned int*)(pak_buffer + moduleParamsOffset - 8) = arm9dst + pak_len;
+	// command line order between equals
+	if (x->saving != y->saving) return x->saving < y->saving ? 1 : -1;
+	return x < y ? -1 : x > y;
+}
 
-  Save(outfilename, pak_buffer, pak_len);
+void JobRanking(JobPool *pool) {
+	RomJob **ranked;
+	unsigned long long size = 0, error = 0;
+	long long saving = 0;
+	int count = 0;
 
-  free(pak_buffer);
-  free(raw_buffer);
+	ranked = (RomJob **) Memory(pool->count, sizeof(RomJob *));
+	for (int i = 0; i < pool->count; i++) {
+		if (pool->jobs[i].estimated) ranked[count++] = &pool->jobs[i];
+	}
+	qsort(ranked, count, sizeof(RomJob *), JobSavingCompare);
+
+	printf("\nExpected savings:\n");
+	for (int i = 0; i < count; i++) {
+		RomJob *job = ranked[i];
+		printf("%3i. %7.2fMB (+/- %.2fMB)  %s - %.2fMB -> %.2fMB\n", i + 1, job->saving / 1048576.0,
+		       job->savingError / 1048576.0, job->tag, job->romSize / 1048576.0,
+		       (job->romSize - job->saving) / 1048576.0);
+		size += job->romSize;
+		saving += job->saving;
+		error += job->savingError;
+	}
+	printf("Total: %.2fMB (+/- %.2fMB) of %.2fMB\n", saving / 1048576.0, error / 1048576.0, size / 1048576.0);
 
-  printf("\n");
+	free(ranked);
 }
 
 /*----------------------------------------------------------------------------*/
-char *BLZ_Code(unsigned char *raw_buffer, int raw_len, int *new_len, int best) {
-  unsigned char *pak_buffer, *pak, *raw, *raw_end, *flg, *tmp;
-  unsigned int   pak_len, inc_len, hdr_len, enc_len, len, pos, max;
-  unsigned int   len_best, pos_best, len_next, pos_next, len_post, pos_post;
-  unsigned int   pak_tmp, raw_tmp, raw_new;
-  unsigned short crc;
-  unsigned char  mask;
+// Takes jobs in command line order, waiting while the memory budget would be
+// exceeded. A job bigger than the whole budget still runs, but on its own.
+void *JobWorker(void *arg) {
+	JobPool *pool = (JobPool *)arg;
+	RomJob *job;
+	Arena arena;
 
-#define SEARCH(l,p) { \
-  l = BLZ_THRESHOLD;                                          \
-                                                              \
-  max = raw - raw_buffer >= BLZ_N ? BLZ_N : raw - raw_buffer; \
-  for (pos = 3; pos <= max; pos++) {                          \
-    for (len = 0; len < BLZ_F; len++) {                       \
-      if (raw + len == raw_end) break;                        \
-      if (len >= pos) break;                                  \
-      if (*(raw + len) != *(raw + len - pos)) break;          \
-    }                                                         \
-                                                              \
-    if (len > l) {                                            \
-      p = pos;                                                \
-      if ((l = len) == BLZ_F) break;                          \
-    }                                                         \
-  }                                                           \
-}
+	memset(&arena, 0, sizeof(Arena));
 
-  pak_tmp = 0;
-  raw_tmp = raw_len;
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->next == pool->count) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		job = &pool->jobs[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+		if (job->skip) continue;
 
-  pak_len = raw_len + ((raw_len + 7) / 8) + 11;
-  pak_buffer = (unsigned char *) Memory(pak_len, sizeof(char));
+		double start = Clock();
+		if (!RomOpen(&job->rom, job->romName)) {
+			Log(job, "- could not open '%s' as a ROM\n", job->romName);
+			continue;
+		}
+		job->stats.open = Clock() - start;
+		// the estimate only reads a few windows of the mapped ROM
+		job->memNeed = pool->estimate ? 0 : JobMemory(job, pool->mode, pool->blzThreads);
 
-  raw_new = raw_len - 0x4000;
-  /* if (arm9) {
-    if (raw_len < 0x4000) {
-      printf(", WARNING: ARM9 must be greater as 16KB, switch [9] disabled");
-    } else if (
-      (*(unsigned int   *)(raw_buffer + 0x0) != 0xE7FFDEFF) ||
+		pthread_mutex_lock(&pool->lock);
+		while (pool->memBudget && pool->memInUse && pool->memInUse + job->memNeed > pool->memBudget) {
+			pthread_cond_wait(&pool->freed, &pool->lock);
+		}
+		pool->memInUse += job->memNeed;
+		pthread_mutex_unlock(&pool->lock);
+
+		job->arena = &arena;
+		if (pool->estimate) JobEstimate(job);
+		else                JobProcess(pool, job);
+		RomClose(&job->rom);
+		job->stats.arenaPeak = arena.peak;
+		ArenaReset(&arena);
+		job->arena = NULL;
+
+		job->stats.total = Clock() - start;
+		if (pool->report != REPORT_NONE && !pool->estimate) JobReport(job, pool->report);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->memInUse -= job->memNeed;
+		pthread_cond_broadcast(&pool->freed);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	ArenaFree(&arena);
+	return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+void JobRun(JobPool *pool, int threads) {
+	pthread_t *workers;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->freed, NULL);
+	pthread_mutex_init(&pool->donors.lock, NULL);
+
+	printf("%i donor ROMs found\n\n", DonorIndex(&pool->donors, DONOR_DIR));
+
+	// every ROM is sorted out before any of them is loaded
+	int queued = 0;
+	for (int i = 0; i < pool->count; i++) {
+		pool->jobs[i].skip = !JobTriage(pool, &pool->jobs[i]);
+		if (!pool->jobs[i].skip) queued++;
+	}
+	printf("\n%i of %i ROMs to %s\n\n", queued, pool->count, pool->estimate ? "estimate" : "optimize");
+
+	if (threads > pool->count) threads = pool->count;
+	if (threads <= 1) {
+		JobWorker(pool);
+	} else {
+		workers = (pthread_t *) Memory(threads, sizeof(pthread_t));
+		for (int i = 0; i < threads; i++) {
+			if (pthread_create(&workers[i], NULL, JobWorker, pool)) EXIT("\nThread create error\n");
+		}
+		for (int i = 0; i < threads; i++) {
+			pthread_join(workers[i], NULL);
+		}
+		free(workers);
+	}
+
+	if (pool->estimate) JobRanking(pool);
+
+	DonorFree(&pool->donors);
+	pthread_mutex_destroy(&pool->donors.lock);
+	pthread_cond_destroy(&pool->freed);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+/*----------------------------------------------------------------------------*/
+// The library side, declared in twlopt.h: the same pipeline as a worker runs,
+// on the caller's buffers and without any files
+struct TWL_Donors {
+	DonorCache cache;
+};
+
+static void LogNone(void *user, const char *line) {
+	(void)user;
+	(void)line;
+}
+
+/*----------------------------------------------------------------------------*/
+TWL_Donors *TWL_DonorsNew(void) {
+	TWL_Donors *donors = (TWL_Donors *) Memory(1, sizeof(TWL_Donors));
+
+	donors->cache.quiet = true;
+	pthread_mutex_init(&donors->cache.lock, NULL);
+
+	return donors;
+}
+
+/*----------------------------------------------------------------------------*/
+// Adds the donor ROMs of a folder laid out as a7donors/dsiware is. Returns how
+// many donors there are now.
+int TWL_DonorsLoad(TWL_Donors *donors, const char *dir) {
+	return DonorIndex(&donors->cache, dir);
+}
+
+/*----------------------------------------------------------------------------*/
+// Adds a donor ROM held by the caller, which has to keep it until
+// TWL_DonorsFree. Its SDK version comes from its module params only.
+bool TWL_DonorsAdd(TWL_Donors *donors, const char *name, const unsigned char *rom, unsigned int size,
+                   bool cameraWifi) {
+	DonorCache *cache = &donors->cache;
+	Donor *donor = (Donor *) Memory(1, sizeof(Donor));
+
+	snprintf(donor->name, sizeof(donor->name), "%s", name != NULL ? name : "");
+	donor->cameraWifi = cameraWifi;
+	donor->rom.data = (unsigned char *)rom;
+	donor->rom.size = size;
+	donor->rom.borrowed = true;
+	if (!RomParse(&donor->rom) || DonorCheck(donor, -1, -1) != NULL) {
+		free(donor);
+		return false;
+	}
+
+	cache->donors = (Donor **) realloc(cache->donors, (cache->count + 1) * sizeof(Donor *));
+	if (cache->donors == NULL) EXIT("\nMemory error\n");
+	cache->donors[cache->count++] = donor;
+
+	return true;
+}
+
+/*----------------------------------------------------------------------------*/
+void TWL_DonorsFree(TWL_Donors *donors) {
+	if (donors == NULL) return;
+	DonorFree(&donors->cache);
+	pthread_mutex_destroy(&donors->cache.lock);
+	free(donors);
+}
+
+/*----------------------------------------------------------------------------*/
+// Sets the job's ROM to the caller's buffer and inspects it as JobTriage does
+static bool TWL_Load(RomJob *job, const unsigned char *data, unsigned int size) {
+	unsigned char *arm9;
+	unsigned int len;
+
+	job->rom.data = (unsigned char *)data;
+	job->rom.size = size;
+	job->rom.borrowed = true;
+	if (!RomParse(&job->rom)) return false;
+
+	len = job->rom.header.arm9len < ARM9_PARAMS + 8 ? job->rom.header.arm9len : ARM9_PARAMS + 8;
+	arm9 = RomView(&job->rom, job->rom.header.arm9src, len);
+	if (arm9 == NULL || !len) return false;
+
+	return JobInspect(job, job->rom.data, arm9, len);
+}
+
+/*----------------------------------------------------------------------------*/
+bool TWL_Inspect(const unsigned char *rom, unsigned int size, TWL_Info *info) {
+	RomJob job;
+
+	memset(info, 0, sizeof(TWL_Info));
+	memset(&job, 0, sizeof(RomJob));
+	job.log = LogNone;
+	if (!TWL_Load(&job, rom, size)) return false;
+
+	info->moduleParams = job.moduleParamsFound;
+	info->sdkVer[0] = job.sdkVer[0];
+	info->sdkVer[1] = job.sdkVer[1];
+	info->arm9Compressed = job.arm9Compressed;
+	info->cameraWifi = job.cameraWifi;
+
+	return true;
+}
+
+/*----------------------------------------------------------------------------*/
+// Optimizes a ROM held in memory, as the command line does without --base.
+// Returns false when the ROM is skipped by the triage, 'result' is empty then.
+// Several calls may run at once, with the same donors or not.
+bool TWL_Optimize(const unsigned char *rom, unsigned int size, TWL_Donors *donors,
+                  const TWL_Options *options, TWL_Result *result) {
+	TWL_Options defaults;
+	DonorCache none;
+	JobPool pool;
+	RomJob job;
+	Arena arena;
+	bool ok;
+
+	memset(result, 0, sizeof(TWL_Result));
+	if (options == NULL) {
+		memset(&defaults, 0, sizeof(defaults));
+		options = &defaults;
+	}
+	if (options->mode < TWL_NORMAL || options->mode > TWL_FAST) return false;
+
+	memset(&pool, 0, sizeof(JobPool));
+	pool.mode = options->mode == TWL_FAST ? BLZ_OPTIMAL | BLZ_FAST : options->mode;
+	pool.budget.growth = options->growth ? options->growth : BLZ_GROWTH;
+	pool.budget.cycles = options->maxCycles;
+	pool.blzThreads = options->threads > 1 ? options->threads : 1;
+	pool.verify = options->verify;
+	pool.overlays = options->overlays;
+	pool.cacheDir = (char *)options->cacheDir;
+	if (pool.cacheDir != NULL) mkdir(pool.cacheDir, 0777);
+
+	memset(&job, 0, sizeof(RomJob));
+	// only names the cache's temporary files, which have to differ between calls
+	snprintf(job.tag, sizeof(job.tag), "twl%p", (void *)&job);
+	job.romName = job.tag;
+	job.log = options->log != NULL ? options->log : LogNone;
+	job.logUser = options->user;
+
+	memset(&none, 0, sizeof(DonorCache));
+	if (!TWL_Load(&job, rom, size) || !JobDonor(donors != NULL ? &donors->cache : &none, &job, job.rom.data)) {
+		return false;
+	}
+
+	memset(&arena, 0, sizeof(Arena));
+	job.arena = &arena;
+	ok = JobOptimize(&pool, &job);
+	if (ok) {
+		if (job.arm9 != NULL) {
+			result->arm9 = (unsigned char *) Memory(job.arm9Len, sizeof(char));
+			memcpy(result->arm9, job.arm9, job.arm9Len);
+			result->arm9Len = job.arm9Len;
+			result->arm9Cycles = job.stats.decodeCycles;
+		}
+		result->arm7 = job.arm7;
+		result->arm7Len = job.arm7Len;
+		result->arm7i = job.arm7i;
+		result->arm7iLen = job.arm7iLen;
+		result->a7mbk6 = job.a7mbk6;
+		result->deviceListAddr = job.deviceListAddr;
+		if (!RomRebuild(&job, NULL, &result->rom, &result->romLen)) Log(&job, "- ROM layout not understood\n");
+	}
+	ArenaFree(&arena);
+
+	return ok;
+}
+
+/*----------------------------------------------------------------------------*/
+void TWL_ResultFree(TWL_Result *result) {
+	if (result->rom != NULL) free(result->rom);
+	if (result->arm9 != NULL) free(result->arm9);
+	memset(result, 0, sizeof(TWL_Result));
+}
+
+/*----------------------------------------------------------------------------*/
+// BLZ-compresses a buffer as an ARM9 binary, its first 16KB kept as they are
+// (mode | TWL_NOHEAD for anything else). Free the result with free().
+unsigned char *TWL_Compress(const unsigned char *raw, unsigned int rawLen, unsigned int *pakLen, int mode,
+                            int threads) {
+	int len;
+
+	if ((mode & ~(BLZ_PADDED | BLZ_NOHEAD)) >= BLZ_MODES || rawLen > RAW_MAXIM) return NULL;
+	if (!(mode & BLZ_NOHEAD) && rawLen < 0x4000) return NULL;
+	unsigned char *pak = BLZ_Code((unsigned char *)raw, rawLen, &len, mode, NULL, threads > 1 ? threads : 1,
+	                              NULL, NULL);
+	*pakLen = len;
+
+	return pak;
+}
+
+/*----------------------------------------------------------------------------*/
+// Decodes a BLZ buffer, NULL when it's malformed or wouldn't decode in place.
+// Free the result with free().
+unsigned char *TWL_Decompress(const unsigned char *pak, unsigned int pakLen, unsigned int *rawLen) {
+	unsigned char *raw;
+	bool safe;
+
+	raw = BLZ_Decode((unsigned char *)pak, pakLen, rawLen, &safe);
+	if (raw != NULL && !safe) {
+		free(raw);
+		raw = NULL;
+	}
+
+	return raw;
+}
+
+/*----------------------------------------------------------------------------*/
+// Patches an uncompressed ARM9 binary for the ARM7 MBK6 setting it will run
+// with. Returns how many places were patched.
+int TWL_PatchArm9(unsigned char *arm9, unsigned int length, unsigned int a7mbk6) {
+	int found[ARM_SIGNATURES];
+	RomJob job;
+
+	memset(&job, 0, sizeof(RomJob));
+	job.log = LogNone;
+	ArmScan(arm9, length, a7mbk6, found);
+
+	return ArmPatch(&job, arm9, found);
+}
+
+/*----------------------------------------------------------------------------*/
+#ifndef TWL_LIBRARY
+int main(int argc, char **argv) {
+  int cmd, mode;
+  int arg;
+
+#ifdef TWL_BENCH
+  return(Bench(argc, argv));
+#endif
+#ifdef TWL_TEST
+  return(Test());
+#endif
+
+  Title();
+
+  if (argc < 2) Usage();
+  /*if      (!strcmp(argv[1], "-d"))   { cmd = CMD_DECODE; }
+  else if (!strcmp(argv[1], "-en"))  { cmd = CMD_ENCODE; mode = BLZ_NORMAL; }
+  else if (!strcmp(argv[1], "-eo"))  { cmd = CMD_ENCODE; mode = BLZ_BEST; }
+  else if (!strcmp(argv[1], "-en9")) { cmd = CMD_ENCODE; mode = BLZ_NORMAL; }
+  else if (!strcmp(argv[1], "-eo9")) { cmd = CMD_ENCODE; mode = BLZ_BEST; }
+  else                                 EXIT("Command not supported\n");
+  if (argc < 3) EXIT("Filename not specified\n");
+
+  switch (cmd) {
+    case CMD_DECODE:
+      for (arg = 2; arg < argc; arg++) BLZ_Decode(argv[arg]);
+      break;
+    case CMD_ENCODE:
+      arm9 = argv[1][3] == '9' ? 1 : 0;
+      for (arg = 2; arg < argc; arg++) BLZ_Encode(argv[arg], mode);
+      break;
+    default:
+      break;
+  }*/
+
+	cmd = CMD_ENCODE; mode = BLZ_NORMAL;
+
+	int romc = 1;
+	int threads = 1;
+	int blzThreads = 1;
+	bool writeBase = false;
+	bool basePatch = false;
+	bool linkDonors = false;
+	bool verify = false;
+	bool overlays = false;
+	bool estimate = false;
+	int report = REPORT_NONE;
+	char *cacheDir = NULL;
+	unsigned int memBudget = 0;
+	BLZ_Budget budget = {BLZ_GROWTH, 0};
+	for (arg = 1; arg < argc; arg++) {
+		if      (!strcmp(argv[arg], "--normal"))  mode = BLZ_NORMAL;
+		else if (!strcmp(argv[arg], "--best"))    mode = BLZ_BEST;
+		else if (!strcmp(argv[arg], "--optimal")) mode = BLZ_OPTIMAL;
+		else if (!strcmp(argv[arg], "--exhaustive")) mode = BLZ_EXHAUSTIVE;
+		else if (!strcmp(argv[arg], "--fast") && arg + 1 < argc) {
+			mode = BLZ_OPTIMAL | BLZ_FAST;
+			budget.growth = atof(argv[++arg]) * 10 + 0.5;
+			budget.cycles = 0;
+		}
+		else if (!strcmp(argv[arg], "--fast-cycles") && arg + 1 < argc) {
+			mode = BLZ_OPTIMAL | BLZ_FAST;
+			budget.cycles = strtoull(argv[++arg], NULL, 10);
+			if (!budget.cycles) EXIT("Cycle ceiling not supported\n");
+		}
+		else if (!strcmp(argv[arg], "--base"))    writeBase = true;
+		else if (!strcmp(argv[arg], "--base-ips")) writeBase = basePatch = true;
+		else if (!strcmp(argv[arg], "--link"))    linkDonors = true;
+		else if (!strcmp(argv[arg], "--verify"))  verify = true;
+		else if (!strcmp(argv[arg], "--overlays")) overlays = true;
+		else if (!strcmp(argv[arg], "--estimate")) estimate = true;
+		else if (!strcmp(argv[arg], "-j") && arg + 1 < argc) threads = atoi(argv[++arg]);
+		else if (!strcmp(argv[arg], "-m") && arg + 1 < argc) memBudget = atoi(argv[++arg]);
+		else if (!strcmp(argv[arg], "-t") && arg + 1 < argc) blzThreads = atoi(argv[++arg]);
+		else if (!strcmp(argv[arg], "--cache") && arg + 1 < argc) cacheDir = argv[++arg];
+		else if (!strcmp(argv[arg], "--report") && arg + 1 < argc) {
+			arg++;
+			if      (!strcmp(argv[arg], "json")) report = REPORT_JSON;
+			else if (!strcmp(argv[arg], "csv"))  report = REPORT_CSV;
+			else                                 EXIT("Report format not supported\n");
+		}
+		else if (argv[arg][0] != '-')             argv[romc++] = argv[arg];
+		else                                      EXIT("Command not supported\n");
+	}
+	if (romc < 2) EXIT("Filename not specified\n");
+	if (blzThreads < 1) blzThreads = 1;
+
+	// nothing is written for an estimate, JobInit's folders fail without it
+	if (!estimate) mkdir("out", 0777);
+
+	JobPool pool;
+	memset(&pool, 0, sizeof(JobPool));
+	pool.count = romc - 1;
+	pool.next = 0;
+	pool.mode = mode;
+	pool.budget = budget;
+	pool.blzThreads = blzThreads;
+	pool.writeBase = writeBase;
+	pool.basePatch = basePatch;
+	pool.verify = verify;
+	pool.overlays = overlays;
+	pool.estimate = estimate;
+	pool.report = report;
+	pool.cacheDir = cacheDir;
+	if (cacheDir != NULL) mkdir(cacheDir, 0777);
+	pool.donors.donors = NULL;
+	pool.donors.count = 0;
+	pool.donors.link = linkDonors;
+	pool.memBudget = (unsigned long long)memBudget << 20;
+	pool.memInUse = 0;
+	pool.jobs = (RomJob *) Memory(pool.count, sizeof(RomJob));
+
+	for (arg = 1; arg < romc; arg++) {
+		JobInit(&pool.jobs[arg - 1], argv[arg]);
+	}
+
+	JobRun(&pool, threads);
+
+	free(pool.jobs);
+
+  printf("\nDone\n");
+
+  return(0);
+}
+#endif
+
+/*----------------------------------------------------------------------------*/
+void Title(void) {
+  printf(
+    "\n"
+    "TWL-ROM-Optimize - Rocket Robz 2022\n"
+    "BLZ compression code from BLZ - (c) CUE 2011\n"
+    "\n"
+  ); 
+}
+
+/*----------------------------------------------------------------------------*/
+void Usage(void) {
+  EXIT(
+    "Usage: TWL-ROM-Optimize [options] romfilename [romfilename [...]]\n"
+    "\n"
+    "--normal    compress the ARM9 binary with greedy matching (default)\n"
+    "--best      compress with the LZ-CUE one-step lookahead\n"
+    "--optimal   compress with an optimal parse, smallest output\n"
+    "--exhaustive try every compression variant at once and keep the smallest\n"
+    "--fast P    compress for the fastest ARM9 decode, at most P%% larger than\n"
+    "            --normal (e.g. 0.5)\n"
+    "--fast-cycles N  the smallest ARM9 binary estimated to decode in N cycles\n"
+    "-j N        process N ROMs at the same time (default 1)\n"
+    "-m MB       memory budget for ROMs being processed at once (default no limit)\n"
+    "-t N        search ARM9 matches with N threads per ROM (default 1)\n"
+    "--base      also write base.nds for injecting the binaries with TinkeDSi\n"
+    "--base-ips  the same, as base.ips to patch the original ROM with\n"
+    "--link      hardlink arm7.bin/arm7i.bin of ROMs sharing a donor to one copy\n"
+    "--verify    decode every compressed ARM9 back and check it\n"
+    "--overlays  also compress the ARM9 overlays (in the rebuilt ROM only)\n"
+    "--report F  write stage timings and counters per ROM, F = json or csv\n"
+    "--cache D   reuse compressed ARM9 binaries stored in folder D\n"
+    "--estimate  only guess what each ROM would save, ranked, writing nothing\n"
+    "\n"
+    "When running, the optimized ROM and its new small ARM binaries will be in\n"
+    "\"out/romfolder/\".\n"
+  );
+}
+
+/*----------------------------------------------------------------------------*/
+void Log(RomJob *job, const char *format, ...) {
+	char line[512];
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+
+	if (job->log != NULL) {
+		job->log(job->logUser, line);
+		return;
+	}
+
+	pthread_mutex_lock(&logLock);
+	printf("[%s] %s", job->tag, line);
+	fflush(stdout);
+	pthread_mutex_unlock(&logLock);
+}
+
+/*----------------------------------------------------------------------------*/
+char *Load(char *filename, unsigned int source, int srcLength) {
+  FILE *fp;
+  char *fb;
+
+  if ((fp = fopen(filename, "rb")) == NULL) EXIT("\nFile open error\n");
+  fseek(fp, source, SEEK_SET);
+  fb = Memory(srcLength, sizeof(char));
+  if (fread(fb, 1, srcLength, fp) != srcLength) EXIT("\nFile read error\n");
+  if (fclose(fp) == EOF) EXIT("\nFile close error\n");
+
+  return(fb);
+}
+
+/*----------------------------------------------------------------------------*/
+void Save(char *filename, unsigned char *buffer, int length) {
+  FILE *fp;
+
+  if ((fp = fopen(filename, "wb")) == NULL) EXIT("\nFile create error\n");
+  if (fwrite(buffer, 1, length, fp) != length) EXIT("\nFile write error\n");
+  if (fclose(fp) == EOF) EXIT("\nFile close error\n");
+}
+
+/*----------------------------------------------------------------------------*/
+char *Memory(int length, int size) {
+  char *fb;
+
+  fb = (char *) calloc(length, size);
+  if (fb == NULL) EXIT("\nMemory error\n");
+
+  return(fb);
+}
+
+/*----------------------------------------------------------------------------*/
+// Not cleared, for buffers that are written in full. With no arena it's a
+// plain malloc the caller frees.
+void *ArenaAlloc(Arena *arena, size_t length) {
+  ArenaBlock *block;
+  size_t      size;
+  void       *fb;
+
+  if (arena == NULL) {
+    fb = malloc(length ? length : 1);
+    if (fb == NULL) EXIT("\nMemory error\n");
+    return(fb);
+  }
+
+  length = (length + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  block = arena->block;
+  if (block == NULL || block->size - block->used < length) {
+    size = block != NULL ? block->size * 2 : ARENA_BLOCK;
+    if (size < length) size = length;
+    block = (ArenaBlock *) malloc(ARENA_HEAD + size);
+    if (block == NULL) EXIT("\nMemory error\n");
+    block->prev = arena->block;
+    block->size = size;
+    block->used = 0;
+    arena->block = block;
+  }
+
+  fb = (char *)block + ARENA_HEAD + block->used;
+  block->used += length;
+  arena->used += length;
+  if (arena->used > arena->peak) arena->peak = arena->used;
+
+  return(fb);
+}
+
+/*----------------------------------------------------------------------------*/
+void *ArenaCalloc(Arena *arena, size_t length) {
+  return(memset(ArenaAlloc(arena, length), 0, length));
+}
+
+/*----------------------------------------------------------------------------*/
+// What ArenaRestore gives back to: everything handed out after this
+ArenaMark ArenaSave(Arena *arena) {
+  ArenaMark mark;
+
+  mark.block = arena->block;
+  mark.blockUsed = arena->block != NULL ? arena->block->used : 0;
+  mark.used = arena->used;
+
+  return(mark);
+}
+
+/*----------------------------------------------------------------------------*/
+void ArenaRestore(Arena *arena, ArenaMark mark) {
+  ArenaBlock *block;
+
+  while (arena->block != mark.block) {
+    block = arena->block;
+    arena->block = block->prev;
+    free(block);
+  }
+  if (arena->block != NULL) arena->block->used = mark.blockUsed;
+  arena->used = mark.used;
+}
+
+/*----------------------------------------------------------------------------*/
+// Gives everything back. When the last job needed more than the block kept,
+// it's swapped for a single one big enough for the largest job so far.
+void ArenaReset(Arena *arena) {
+  ArenaBlock *block;
+
+  if (arena->peak > arena->most) arena->most = arena->peak;
+
+  block = arena->block;
+  if (block != NULL && (block->prev != NULL || block->size < arena->most)) {
+    ArenaFree(arena);
+    block = (ArenaBlock *) malloc(ARENA_HEAD + arena->most);
+    if (block != NULL) {
+      block->prev = NULL;
+      block->size = arena->most;
+      arena->block = block;
+    }
+  }
+  if (arena->block != NULL) arena->block->used = 0;
+
+  arena->used = 0;
+  arena->peak = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+void ArenaFree(Arena *arena) {
+  ArenaBlock *block;
+
+  while ((block = arena->block) != NULL) {
+    arena->block = block->prev;
+    free(block);
+  }
+  arena->used = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+// Opens the ROM once: mapped where the platform allows it, read whole
+// otherwise. Fails quietly, so callers can probe for optional files.
+bool RomOpen(RomHandle *rom, char *filename) {
+  memset(rom, 0, sizeof(RomHandle));
+
+#ifdef _WIN32
+  FILE *fp;
+
+  if ((fp = fopen(filename, "rb")) == NULL) return(false);
+  fseek(fp, 0, SEEK_END);
+  rom->size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  if (rom->size) {
+    rom->data = (unsigned char *) Memory(rom->size, sizeof(char));
+    if (fread(rom->data, 1, rom->size, fp) != rom->size) rom->size = 0;
+  }
+  fclose(fp);
+#else
+  struct stat st;
+  unsigned char *data;
+  int fd;
+
+  if ((fd = open(filename, O_RDONLY)) < 0) return(false);
+  if (!fstat(fd, &st) && st.st_size > 0 && st.st_size <= 0xFFFFFFFF) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      rom->data = data;
+      rom->size = st.st_size;
+      rom->mapped = true;
+    }
+  }
+  close(fd);
+#endif
+
+  if (!RomParse(rom)) {
+    RomClose(rom);
+    return(false);
+  }
+
+  return(true);
+}
+
+/*----------------------------------------------------------------------------*/
+// Reads the header fields of a ROM already in memory
+bool RomParse(RomHandle *rom) {
+  NdsHeader     *header = &rom->header;
+  unsigned char *data = rom->data;
+
+  if (rom->size < 0x200) return(false);
+
+  memcpy(header->titleID, data + 0x0C, 4);
+  header->arm9src        = *(unsigned int *)(data + 0x20);
+  header->arm9entry      = *(unsigned int *)(data + 0x24);
+  header->arm9dst        = *(unsigned int *)(data + 0x28);
+  header->arm9len        = *(unsigned int *)(data + 0x2C);
+  header->arm7src        = *(unsigned int *)(data + 0x30);
+  header->arm7entry      = *(unsigned int *)(data + 0x34);
+  header->arm7dst        = *(unsigned int *)(data + 0x38);
+  header->arm7len        = *(unsigned int *)(data + 0x3C);
+  header->a7mbk6         = *(unsigned int *)(data + 0x1A0);
+  header->arm9isrc       = *(unsigned int *)(data + 0x1C0);
+  header->arm9idst       = *(unsigned int *)(data + 0x1C8);
+  header->arm9ilen       = *(unsigned int *)(data + 0x1CC);
+  header->arm7isrc       = *(unsigned int *)(data + 0x1D0);
+  header->deviceListAddr = *(unsigned int *)(data + 0x1D4);
+  header->arm7idst       = *(unsigned int *)(data + 0x1D8);
+  header->arm7ilen       = *(unsigned int *)(data + 0x1DC);
+
+  return(true);
+}
+
+/*----------------------------------------------------------------------------*/
+void RomClose(RomHandle *rom) {
+  if (rom->data != NULL && !rom->borrowed) {
+#ifdef _WIN32
+    free(rom->data);
+#else
+    if (rom->mapped) munmap(rom->data, rom->size);
+    else             free(rom->data);
+#endif
+  }
+  rom->data = NULL;
+  rom->size = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+// Zero-copy view of a ROM region, NULL when it doesn't fit in the file
+unsigned char *RomView(RomHandle *rom, unsigned int offset, unsigned int length) {
+  if (offset > rom->size || length > rom->size - offset) return(NULL);
+
+  return(rom->data + offset);
+}
+
+/*----------------------------------------------------------------------------*/
+int RomItemCompare(const void *a, const void *b) {
+  const RomItem *x = (const RomItem *)a, *y = (const RomItem *)b;
+
+  if (x->twl != y->twl) return(x->twl ? 1 : -1);
+  if (x->src != y->src) return(x->src < y->src ? -1 : 1);
+  return(x->len < y->len ? -1 : x->len > y->len);
+}
+
+/*----------------------------------------------------------------------------*/
+// Where RomRebuild writes: a file, or a buffer of the final size
+typedef struct {
+  FILE          *fp;
+  unsigned char *data;
+  unsigned int   pos;
+} RomSink;
+
+bool RomPut(RomSink *sink, unsigned char *data, unsigned int length) {
+  if (sink->fp == NULL) memcpy(sink->data + sink->pos, data, length);
+  else if (fwrite(data, 1, length, sink->fp) != length) return(false);
+  sink->pos += length;
+
+  return(true);
+}
+
+/*----------------------------------------------------------------------------*/
+void RomPad(RomSink *sink, unsigned int length) {
+  unsigned char fill[0x200];
+
+  if (sink->fp == NULL) {
+    memset(sink->data + sink->pos, 0xFF, length);
+    sink->pos += length;
+    return;
+  }
+
+  memset(fill, 0xFF, sizeof(fill));
+  for (; length > sizeof(fill); length -= sizeof(fill)) RomPut(sink, fill, sizeof(fill));
+  RomPut(sink, fill, length);
+}
+
+/*----------------------------------------------------------------------------*/
+// Writes the final ROM in one pass: the header area, then every block the
+// header and the FAT point to, in their original order but packed back to
+// back, with the job's new ARM9/ARM7/ARM7i in place of the old ones. Slack
+// between blocks is dropped, the TWL region (ARM9i, ARM7i, digest tables)
+// starts at the next 512KB unit after the NTR region. Written to 'outfilename',
+// or when it's NULL to a new buffer returned in *buffer and *length (only the
+// length when 'buffer' is NULL too). Returns false, writing nothing, when
+// blocks overlap or fall outside the ROM.
+bool RomRebuild(RomJob *job, char *outfilename, unsigned char **buffer, unsigned int *length) {
+  static const int fields[][2] = {
+    {0x020, 0x02C}, {0x030, 0x03C}, {0x040, 0x044}, {0x048, 0x04C}, // ARM9, ARM7, FNT, FAT
+    {0x050, 0x054}, {0x058, 0x05C}, {0x068, -1},                    // overlay tables, banner
+    {0x1C0, 0x1CC}, {0x1D0, 0x1DC}, {0x1F0, 0x1F4}, {0x1F8, 0x1FC}, // ARM9i, ARM7i, digests
+  };
+  RomHandle     *rom = &job->rom;
+  unsigned char *src = rom->data, *header, *fat, *data;
+  RomItem       *items, *item, *prev;
+  unsigned int   count, fatCount, hdr_len, twlStart, twlSrc, ntrEnd, pos, off, len, i, j;
+  bool           dsi, ok;
+  RomSink        sink;
+  ArenaMark      mark = ArenaSave(job->arena);
+
+  dsi = src[0x12] & 2;
+  twlSrc = dsi ? (unsigned int)*(unsigned short *)(src + 0x92) << 19 : 0;
+  if (!twlSrc) twlSrc = 0xFFFFFFFF;
+
+  fatCount = *(unsigned int *)(src + 0x4C) / 8;
+  fat = RomView(rom, *(unsigned int *)(src + 0x48), fatCount * 8);
+  if (fat == NULL) return(false);
+
+  items = (RomItem *) ArenaAlloc(job->arena, (sizeof(fields) / sizeof(fields[0]) + 1 + fatCount) * sizeof(RomItem));
+  count = 0;
+
+  for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    if (fields[i][0] >= 0x180 && !dsi) continue;
+    off = *(unsigned int *)(src + fields[i][0]);
+    if (fields[i][1] >= 0) {
+      len = *(unsigned int *)(src + fields[i][1]);
+    } else if (dsi && *(unsigned int *)(src + 0x208)) {
+      len = *(unsigned int *)(src + 0x208);
+    } else {
+      len = off + 2 <= rom->size ? *(unsigned short *)(src + off) : 0;
+      len = len == 0x0103 ? 0x23C0 : len == 0x0003 ? 0x1240 : len == 0x0002 ? 0x0940 : 0x0840;
+    }
+    if (!off || !len) continue;
+
+    item = &items[count++];
+    item->src = off;
+    item->len = len;
+    item->data = src + off;
+    item->size = len;
+    item->align = 0x200;
+    item->field = fields[i][0];
+    item->sizeField = fields[i][1];
+    item->fatIndex = -1;
+    item->twl = off >= twlSrc;
+
+    if (item->field == 0x020 && job->arm9 != NULL) {
+      item->data = job->arm9;
+      item->size = job->arm9Len;
+    } else if (item->field == 0x030 && job->arm7 != NULL) {
+      item->data = job->arm7;
+      item->size = job->arm7Len;
+    } else if (item->field == 0x1D0 && job->arm7i != NULL) {
+      item->data = job->arm7i;
+      item->size = job->arm7iLen;
+    } else if (item->field == 0x050 && job->ovt != NULL) {
+      item->data = job->ovt;
+    }
+
+    // the ARM9 footer (nitrocode, module params offset) stays right behind it
+    if (item->field == 0x020 && off + len + 12 <= rom->size && *(unsigned int *)(src + off + len) == 0xDEC00621) {
+      item = &items[count++];
+      *item = items[count - 2];
+      item->src = item->src + item->len;
+      item->len = item->size = 12;
+      item->data = src + item->src;
+      item->align = 1;
+      item->field = item->sizeField = -1;
+    }
+  }
+
+  for (i = 0; i < fatCount; i++) {
+    off = *(unsigned int *)(fat + i * 8);
+    len = *(unsigned int *)(fat + i * 8 + 4) - off;
+    if (!off) continue;
+
+    item = &items[count++];
+    item->src = off;
+    item->len = len;
+    item->data = src + off;
+    item->size = len;
+    item->align = 0x200;
+    item->field = item->sizeField = -1;
+    item->fatIndex = i;
+    item->twl = off >= twlSrc;
+
+    if (job->fileData != NULL && job->fileData[i] != NULL) {
+      item->data = job->fileData[i];
+      item->size = job->fileLen[i];
+    }
+  }
+
+  qsort(items, count, sizeof(RomItem), RomItemCompare);
+
+  // everything before the first block is the header area, kept as it is
+  hdr_len = count ? items[0].src : rom->size;
+  for (i = 1; i < count; i++)
+    if (!items[i].twl && items[i].src < hdr_len) hdr_len = items[i].src;
+
+  ok = count && hdr_len >= 0x200;
+  ntrEnd = twlStart = pos = hdr_len;
+  for (i = 0, prev = NULL; ok && i < count; prev = item, i++) {
+    item = &items[i];
+    if (item->src > rom->size || item->len > rom->size - item->src) ok = false;
+
+    if (prev != NULL && prev->twl == item->twl && item->src < prev->src + prev->len) {
+      // the same data listed twice is written once, anything else overlapping is not understood
+      if (item->src == prev->src && item->len == prev->len && item->data == prev->data) {
+        item->dst = prev->dst;
+        item->data = NULL;
+        continue;
+      }
+      ok = false;
+    }
+
+    if (item->twl && (prev == NULL || !prev->twl)) {
+      ntrEnd = pos;
+      twlStart = (pos + 0x7FFFF) & -0x80000;
+      pos = twlStart + item->src - twlSrc;
+    }
+
+    pos = (pos + item->align - 1) & -item->align;
+    item->dst = pos;
+    pos += item->size;
+  }
+  if (count && !items[count - 1].twl) ntrEnd = twlStart = pos;
+
+  if (!ok || (outfilename == NULL && buffer == NULL)) {
+    if (ok) *length = pos;
+    ArenaRestore(job->arena, mark);
+    return(ok);
+  }
+
+  // the FAT block is written from a rebuilt copy
+  fat = (unsigned char *) ArenaCalloc(job->arena, fatCount * 8 + 1);
+  for (i = 0; i < count; i++) {
+    item = &items[i];
+    if (item->fatIndex < 0) continue;
+    *(unsigned int *)(fat + item->fatIndex * 8) = item->dst;
+    *(unsigned int *)(fat + item->fatIndex * 8 + 4) = item->dst + item->size;
+  }
+
+  header = (unsigned char *) ArenaAlloc(job->arena, hdr_len);
+  memcpy(header, src, hdr_len);
+
+  for (i = 0; i < count; i++) {
+    item = &items[i];
+    if (item->field >= 0) *(unsigned int *)(header + item->field) = item->dst;
+    if (item->sizeField >= 0) *(unsigned int *)(header + item->sizeField) = item->size;
+    if (item->field == 0x048 && item->data != NULL) item->data = fat;
+  }
+
+  if (job->donor != NULL) {
+    *(unsigned int *)(header + 0x34) = job->donor->rom.header.arm7entry;
+    *(unsigned int *)(header + 0x38) = job->donor->rom.header.arm7dst;
+    if (dsi) *(unsigned int *)(header + 0x1D8) = job->donor->rom.header.arm7idst;
+  }
+  *(unsigned int *)(header + 0x80) = ntrEnd;
+
+  if (dsi) {
+    *(unsigned int *)(header + 0x1A0) = job->a7mbk6;
+    *(unsigned int *)(header + 0x1D4) = job->deviceListAddr;
+    if (*(unsigned short *)(header + 0x90)) *(unsigned short *)(header + 0x90) = twlStart >> 19;
+    if (*(unsigned short *)(header + 0x92)) *(unsigned short *)(header + 0x92) = twlStart >> 19;
+    if (*(unsigned int *)(header + 0x1E0)) {
+      *(unsigned int *)(header + 0x1E4) = ntrEnd - *(unsigned int *)(header + 0x1E0);
+    }
+    if (*(unsigned int *)(header + 0x1E8)) {
+      *(unsigned int *)(header + 0x1E8) = twlStart;
+      *(unsigned int *)(header + 0x1EC) = pos - twlStart;
+    }
+    if (*(unsigned int *)(header + 0x210)) *(unsigned int *)(header + 0x210) = pos;
+
+    // modcrypt areas follow the block they start in
+    for (j = 0x220; j <= 0x228; j += 8) {
+      off = *(unsigned int *)(header + j);
+      for (i = 0; off && i < count; i++) {
+        item = &items[i];
+        if (item->data != NULL && off >= item->src && off < item->src + item->len) {
+          len = item->size - (off - item->src);
+          *(unsigned int *)(header + j) = item->dst + off - item->src;
+          if (*(unsigned int *)(header + j + 4) > len) *(unsigned int *)(header + j + 4) = len;
+          break;
+        }
+      }
+    }
+  }
+
+  *(unsigned short *)(header + 0x15E) = BLZ_CRC16(header, 0x15E);
+
+  memset(&sink, 0, sizeof(sink));
+  if (outfilename == NULL) {
+    sink.data = (unsigned char *) Memory(pos, sizeof(char));
+    *buffer = sink.data;
+    *length = pos;
+  } else if ((sink.fp = fopen(outfilename, "wb")) == NULL) EXIT("\nFile create error\n");
+  RomPut(&sink, header, hdr_len);
+  for (i = 0, pos = hdr_len, prev = NULL; i < count; prev = item, i++) {
+    item = &items[i];
+    if (item->twl && (prev == NULL || !prev->twl)) {
+      // whatever leads the TWL region up to its first block is kept
+      RomPad(&sink, twlStart - pos);
+      RomPut(&sink, src + twlSrc, item->src - twlSrc);
+      pos = twlStart + item->src - twlSrc;
+    }
+    if (item->data == NULL) continue;
+    RomPad(&sink, item->dst - pos);
+    data = item->data;
+    // a new binary where a modcrypt area now starts, as a donor's ARM7i, is
+    // encrypted for it; the ROM's own blocks already are
+    if (dsi && hdr_len >= DSI_HEADER && (data < src || data >= src + rom->size)
+     && ModcryptCovers(header, item->dst, item->size)) {
+      data = (unsigned char *) ArenaAlloc(job->arena, item->size);
+      memcpy(data, item->data, item->size);
+      ModcryptRegion(header, data, item->dst, item->size);
+    }
+    if (!RomPut(&sink, data, item->size)) EXIT("\nFile write error\n");
+    if (item->data >= src && item->data < src + rom->size) job->stats.bytesRead += item->size;
+    pos = item->dst + item->size;
+  }
+  if (sink.fp != NULL && fclose(sink.fp) == EOF) EXIT("\nFile close error\n");
+  job->stats.bytesRead += hdr_len;
+  job->stats.bytesWritten += pos;
+
+  ArenaRestore(job->arena, mark);
+
+  return(true);
+}
+
+/*----------------------------------------------------------------------------*/
+// First offset of every signature enabled for this ROM, -1 if not found. The
+// first halfword of each one goes into a bitmap, so only the few offsets that
+// pass it get compared and adding signatures doesn't add passes.
+void ArmScan(unsigned char *buffer, unsigned int length, uint32_t a7mbk6, int *found) {
+  const ArmSignature *sign;
+  unsigned char filter[0x10000 / 8];
+  unsigned int  i, left, width;
+  uint16_t      first;
+  int           k, e;
+
+  memset(filter, 0, sizeof(filter));
+  left = 0;
+  for (k = 0; k < ARM_SIGNATURES; k++) {
+    sign = &armSignatures[k];
+    found[k] = -1;
+    if (sign->a7mbk6 && sign->a7mbk6 != a7mbk6) {
+      found[k] = -2;  // disabled for this ROM
+      continue;
+    }
+    filter[(sign->sig[0] & 0xFFFF) >> 3] |= 1 << (sign->sig[0] & 7);
+    filter[(sign->alt[0] & 0xFFFF) >> 3] |= 1 << (sign->alt[0] & 7);
+    left++;
+  }
+
+  for (i = 0; left && i + 2 <= length; i += 2) {
+    first = *(uint16_t *)(buffer + i);
+    if (!(filter[first >> 3] & (1 << (first & 7)))) continue;
+
+    for (k = 0; k < ARM_SIGNATURES; k++) {
+      if (found[k] != -1) continue;
+      sign = &armSignatures[k];
+      if (!sign->thumb && (i & 3)) continue;
+      width = sign->thumb ? 2 : 4;
+      if (i + sign->count * width > length) continue;
+
+      for (e = 0; e < sign->count; e++) {
+        uint32_t value = sign->thumb ? *(uint16_t *)(buffer + i + e * 2) : *(uint32_t *)(buffer + i + e * 4);
+        if (value != sign->sig[e] && value != sign->alt[e]) break;
+      }
+      if (e == sign->count) {
+        found[k] = i;
+        left--;
+      }
+    }
+  }
+
+  for (k = 0; k < ARM_SIGNATURES; k++) if (found[k] < 0) found[k] = -1;
+}
+
+/*----------------------------------------------------------------------------*/
+// Returns how many signatures were patched
+int ArmPatch(RomJob *job, unsigned char *buffer, int *found) {
+  const ArmSignature *sign;
+  int k, j, patched = 0;
+
+  for (k = 0; k < ARM_SIGNATURES; k++) {
+    sign = &armSignatures[k];
+    if (!sign->patched || found[k] < 0) continue;
+
+    // an earlier entry of the same group takes precedence
+    for (j = 0; j < k; j++) {
+      if (sign->group && armSignatures[j].group == sign->group && armSignatures[j].patched && found[j] >= 0) break;
+    }
+    if (j < k) continue;
+
+    if (sign->thumb) *(uint16_t *)(buffer + found[k]) = sign->patch;
+    else             *(uint32_t *)(buffer + found[k]) = sign->patch;
+    Log(job, "- patching %s\n", sign->name);
+    patched++;
+  }
+
+  return(patched);
+}
+
+/*----------------------------------------------------------------------------*/
+// Checks a donor whose ROM is open: it has to be a DSi ROM holding both of its
+// ARM7 binaries, with module params giving SDK major.minor (either one -1 for
+// any). Sets its binaries and SDK version, returns why it can't be used or NULL.
+const char *DonorCheck(Donor *donor, int major, int minor) {
+  RomHandle     *rom = &donor->rom;
+  unsigned char *arm9;
+  unsigned int   len;
+  int            found[ARM_SIGNATURES], off;
+
+  if (!(rom->data[0x12] & 2)) return("not a DSi ROM");
+
+  donor->arm7Len = rom->header.arm7len;
+  donor->arm7iLen = rom->header.arm7ilen;
+  donor->arm7 = RomView(rom, rom->header.arm7src, donor->arm7Len);
+  donor->arm7i = RomView(rom, rom->header.arm7isrc, donor->arm7iLen);
+  len = rom->header.arm9len < ARM9_PARAMS + 8 ? rom->header.arm9len : ARM9_PARAMS + 8;
+  arm9 = RomView(rom, rom->header.arm9src, len);
+  if (donor->arm7 == NULL || donor->arm7i == NULL || !donor->arm7Len || !donor->arm7iLen || arm9 == NULL) {
+    return("ARM7/ARM7i binary is out of the ROM");
+  }
+
+  ArmScan(arm9, len, 0, found);
+  off = found[ARM_MODULE_PARAMS];
+  if (off < 8 || off >= ARM9_PARAMS) return("no module params");
+  donor->sdkVer[0] = arm9[off - 1];
+  donor->sdkVer[1] = arm9[off - 2];
+  if ((major >= 0 && donor->sdkVer[0] != major) || (minor >= 0 && donor->sdkVer[1] != minor)) {
+    return("built with another SDK");
+  }
+
+  // used decrypted, a ROM it goes into encrypts it with its own key
+  if (rom->size >= DSI_HEADER && ModcryptCovers(rom->data, rom->header.arm7isrc, donor->arm7iLen)) {
+    donor->arm7iPlain = (unsigned char *) Memory(donor->arm7iLen, sizeof(char));
+    memcpy(donor->arm7iPlain, donor->arm7i, donor->arm7iLen);
+    ModcryptRegion(rom->data, donor->arm7iPlain, rom->header.arm7isrc, donor->arm7iLen);
+    donor->arm7i = donor->arm7iPlain;
+  }
+
+  return(NULL);
+}
+
+/*----------------------------------------------------------------------------*/
+// Opens the donor ROMs of both sets in 'path', named sdkXY.nds for SDK X.Y,
+// and adds the ones DonorCheck keeps. Returns how many there are now.
+int DonorIndex(DonorCache *cache, const char *path) {
+  DIR           *dir;
+  struct dirent *entry;
+  Donor         *donor;
+  char           set[256];
+  int            camera;
+  const char    *name, *error;
+
+  for (camera = 0; camera < 2; camera++) {
+    snprintf(set, sizeof(set), camera ? "%s/camerawifi" : "%s", path);
+    if ((dir = opendir(set)) == NULL) continue;
+
+    while ((entry = readdir(dir)) != NULL) {
+      name = entry->d_name;
+      if (strlen(name) != 9 || strncmp(name, "sdk", 3) || strcmp(name + 5, ".nds")
+       || name[3] < '0' || name[3] > '9' || name[4] < '0' || name[4] > '9') continue;
+
+      donor = (Donor *) Memory(1, sizeof(Donor));
+      snprintf(donor->name, sizeof(donor->name), "%s/%s", set, name);
+      donor->cameraWifi = camera;
+
+      if (!RomOpen(&donor->rom, donor->name)) error = "not a DSi ROM";
+      else                                    error = DonorCheck(donor, name[3] - '0', name[4] - '0');
+      if (error != NULL) {
+        if (!cache->quiet) printf("Donor '%s' not used, %s\n", donor->name, error);
+        RomClose(&donor->rom);
+        free(donor);
+        continue;
+      }
+
+      cache->donors = (Donor **) realloc(cache->donors, (cache->count + 1) * sizeof(Donor *));
+      if (cache->donors == NULL) EXIT("\nMemory error\n");
+      cache->donors[cache->count++] = donor;
+    }
+
+    closedir(dir);
+  }
+
+  return(cache->count);
+}
+
+/*----------------------------------------------------------------------------*/
+// Donor for a ROM: its SDK version, or the closest older release of it. The
+// set without camera and wireless is smaller and taken when the ROM doesn't
+// need them, the camerawifi set otherwise or when it's all there is.
+Donor *DonorGet(DonorCache *cache, RomJob *job) {
+  Donor *donor, *best;
+  int    i;
+
+  best = NULL;
+  for (i = 0; i < cache->count; i++) {
+    donor = cache->donors[i];
+    if (donor->sdkVer[0] != job->sdkVer[0] || donor->sdkVer[1] > job->sdkVer[1]) continue;
+    if (job->cameraWifi && !donor->cameraWifi) continue;
+    if (best == NULL || donor->cameraWifi < best->cameraWifi
+     || (donor->cameraWifi == best->cameraWifi && donor->sdkVer[1] > best->sdkVer[1])) best = donor;
+  }
+
+  return(best);
+}
+
+/*----------------------------------------------------------------------------*/
+// Writes a donor binary, as a hardlink to its first copy when asked to.
+// Returns false when it was linked.
+bool DonorSave(DonorCache *cache, char *filename, unsigned char *buffer, int length, char *saved) {
+  pthread_mutex_lock(&cache->lock);
+
+#ifndef _WIN32
+  if (cache->link && saved[0]) {
+    unlink(filename);
+    if (!link(saved, filename)) {
+      pthread_mutex_unlock(&cache->lock);
+      return(false);
+    }
+  }
+#endif
+
+  if (!saved[0]) strcpy(saved, filename);
+
+  pthread_mutex_unlock(&cache->lock);
+
+  Save(filename, buffer, length);
+
+  return(true);
+}
+
+/*----------------------------------------------------------------------------*/
+void DonorFree(DonorCache *cache) {
+  for (int i = 0; i < cache->count; i++) {
+    if (cache->donors[i]->arm7iPlain != NULL) free(cache->donors[i]->arm7iPlain);
+    RomClose(&cache->donors[i]->rom);
+    free(cache->donors[i]);
+  }
+  free(cache->donors);
+  cache->donors = NULL;
+  cache->count = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+// AES-128 for modcrypt, encryption only as CTR needs no more. The round keys
+// are laid out as in FIPS-197, which is also what AES-NI takes.
+static const unsigned char aesSbox[256] = {
+  0x63, 0x7C, 0x77, 0x7B, 0xF2, 0x6B, 0x6F, 0xC5, 0x30, 0x01, 0x67, 0x2B, 0xFE, 0xD7, 0xAB, 0x76,
+  0xCA, 0x82, 0xC9, 0x7D, 0xFA, 0x59, 0x47, 0xF0, 0xAD, 0xD4, 0xA2, 0xAF, 0x9C, 0xA4, 0x72, 0xC0,
+  0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC, 0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
+  0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A, 0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
+  0x09, 0x83, 0x2C, 0x1A, 0x1B, 0x6E, 0x5A, 0xA0, 0x52, 0x3B, 0xD6, 0xB3, 0x29, 0xE3, 0x2F, 0x84,
+  0x53, 0xD1, 0x00, 0xED, 0x20, 0xFC, 0xB1, 0x5B, 0x6A, 0xCB, 0xBE, 0x39, 0x4A, 0x4C, 0x58, 0xCF,
+  0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85, 0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
+  0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5, 0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
+  0xCD, 0x0C, 0x13, 0xEC, 0x5F, 0x97, 0x44, 0x17, 0xC4, 0xA7, 0x7E, 0x3D, 0x64, 0x5D, 0x19, 0x73,
+  0x60, 0x81, 0x4F, 0xDC, 0x22, 0x2A, 0x90, 0x88, 0x46, 0xEE, 0xB8, 0x14, 0xDE, 0x5E, 0x0B, 0xDB,
+  0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C, 0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
+  0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9, 0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
+  0xBA, 0x78, 0x25, 0x2E, 0x1C, 0xA6, 0xB4, 0xC6, 0xE8, 0xDD, 0x74, 0x1F, 0x4B, 0xBD, 0x8B, 0x8A,
+  0x70, 0x3E, 0xB5, 0x66, 0x48, 0x03, 0xF6, 0x0E, 0x61, 0x35, 0x57, 0xB9, 0x86, 0xC1, 0x1D, 0x9E,
+  0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94, 0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
+  0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16
+};
+
+#define AES_XTIME(x)  ((unsigned char)(((x) << 1) ^ ((x) & 0x80 ? 0x1B : 0)))
+
+void AesExpand(const unsigned char *key, unsigned char *rk) {
+  unsigned char t[4], rcon, u;
+  int           i;
+
+  memcpy(rk, key, 16);
+  for (i = 16, rcon = 1; i < 176; i += 4) {
+    memcpy(t, rk + i - 4, 4);
+    if (!(i & 15)) {
+      u = t[0];
+      t[0] = aesSbox[t[1]] ^ rcon;
+      t[1] = aesSbox[t[2]];
+      t[2] = aesSbox[t[3]];
+      t[3] = aesSbox[u];
+      rcon = AES_XTIME(rcon);
+    }
+    rk[i + 0] = rk[i - 16] ^ t[0];
+    rk[i + 1] = rk[i - 15] ^ t[1];
+    rk[i + 2] = rk[i - 14] ^ t[2];
+    rk[i + 3] = rk[i - 13] ^ t[3];
+  }
+}
+
+void AesEncrypt(const unsigned char *rk, const unsigned char *in, unsigned char *out) {
+  unsigned char s[16], t[16], a, b, c, d, e;
+  int           round, i;
+
+  for (i = 0; i < 16; i++) s[i] = in[i] ^ rk[i];
+
+  for (round = 1; round <= 10; round++) {
+    // SubBytes and ShiftRows, the state being column by column
+    for (i = 0; i < 16; i++) t[i] = aesSbox[s[(i + 4 * (i & 3)) & 15]];
+    if (round < 10) {
+      for (i = 0; i < 16; i += 4) {
+        a = t[i]; b = t[i + 1]; c = t[i + 2]; d = t[i + 3];
+        e = a ^ b ^ c ^ d;
+        t[i + 0] ^= e ^ AES_XTIME(a ^ b);
+        t[i + 1] ^= e ^ AES_XTIME(b ^ c);
+        t[i + 2] ^= e ^ AES_XTIME(c ^ d);
+        t[i + 3] ^= e ^ AES_XTIME(d ^ a);
+      }
+    }
+    for (i = 0; i < 16; i++) s[i] = t[i] ^ rk[16 * round + i];
+  }
+
+  memcpy(out, s, 16);
+}
+
+/*----------------------------------------------------------------------------*/
+// The CTR kernels, one block at a time here. Counters are big-endian in
+// their AES byte order.
+static inline void ModcryptAdd(unsigned char *ctr, unsigned int n) {
+  unsigned int sum = 0;
+
+  for (int i = 15; i >= 0; i--) {
+    sum += ctr[i] + (i >= 12 ? (n >> (8 * (15 - i))) & 0xFF : 0);
+    ctr[i] = sum;
+    sum >>= 8;
+  }
+}
+
+static void ModcryptPortable(const unsigned char *rk, unsigned char *ctr, unsigned char *buffer,
+                             unsigned int blocks) {
+  unsigned char stream[16];
+
+  for ( ; blocks--; buffer += 16) {
+    AesEncrypt(rk, ctr, stream);
+    for (int i = 0; i < 16; i++) buffer[i] ^= stream[15 - i];
+    ModcryptAdd(ctr, 1);
+  }
+}
+
+#ifdef BLZ_SIMD
+// Four blocks at once, so that AESENC's latency is hidden
+__attribute__((target("aes,ssse3")))
+static void ModcryptAESNI(const unsigned char *rk, unsigned char *ctr, unsigned char *buffer, unsigned int blocks) {
+  const __m128i swap = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+  __m128i       key[11], x[4];
+  uint64_t      hi, lo;
+  unsigned int  i, n, j;
+
+  for (i = 0; i < 11; i++) key[i] = _mm_loadu_si128((const __m128i *)(rk + 16 * i));
+  hi = lo = 0;
+  for (i = 0; i < 8; i++) {
+    hi = hi << 8 | ctr[i];
+    lo = lo << 8 | ctr[8 + i];
+  }
+
+  while (blocks) {
+    n = blocks < 4 ? blocks : 4;
+    for (j = 0; j < n; j++) {
+      // the counter block in AES byte order is the 128-bit number reversed
+      x[j] = _mm_shuffle_epi8(_mm_set_epi64x((long long)hi, (long long)lo), swap);
+      x[j] = _mm_xor_si128(x[j], key[0]);
+      if (!++lo) hi++;
+    }
+    for (i = 1; i < 10; i++) {
+      for (j = 0; j < n; j++) x[j] = _mm_aesenc_si128(x[j], key[i]);
+    }
+    for (j = 0; j < n; j++) {
+      x[j] = _mm_shuffle_epi8(_mm_aesenclast_si128(x[j], key[10]), swap);
+      _mm_storeu_si128((__m128i *)buffer, _mm_xor_si128(_mm_loadu_si128((__m128i *)buffer), x[j]));
+      buffer += 16;
+    }
+    blocks -= n;
+  }
+
+  for (i = 0; i < 8; i++) {
+    ctr[7 - i] = hi >> (8 * i);
+    ctr[15 - i] = lo >> (8 * i);
+  }
+}
+#endif
+
+/*----------------------------------------------------------------------------*/
+// AES-NI is only taken when it gives the FIPS-197 answer, and the same
+// keystream as the portable code does
+void ModcryptInit(void) {
+  static const unsigned char plain[16] = {
+    0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF
+  };
+  static const unsigned char cipher[16] = {
+    0x69, 0xC4, 0xE0, 0xD8, 0x6A, 0x7B, 0x04, 0x30, 0xD8, 0xCD, 0xB7, 0x80, 0x70, 0xB4, 0xC5, 0x5A
+  };
+  unsigned char key[16], rk[176], out[16], ctr[2][16], data[2][16 * 7];
+  int           i;
+
+  for (i = 0; i < 16; i++) key[i] = i;
+  AesExpand(key, rk);
+  AesEncrypt(rk, plain, out);
+  if (memcmp(out, cipher, 16)) EXIT("\nAES self-test error\n");
+
+  modcryptCtr = ModcryptPortable;
+#ifdef BLZ_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("ssse3")) {
+    // a counter that carries into its upper half on the way
+    memset(ctr[0], 0, 16);
+    memset(ctr[0] + 8, 0xFF, 8);
+    ctr[0][15] = 0xFD;
+    memcpy(ctr[1], ctr[0], 16);
+    memset(data, 0, sizeof(data));
+    ModcryptPortable(rk, ctr[0], data[0], 7);
+    ModcryptAESNI(rk, ctr[1], data[1], 7);
+    if (!memcmp(data[0], data[1], sizeof(data[0])) && !memcmp(ctr[0], ctr[1], 16)) modcryptCtr = ModcryptAESNI;
+  }
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+// Round keys for a DSi header's modcrypt areas. Retail titles scramble key X
+// ("Nintendo", the game code and the game code reversed) with key Y from
+// 0x350, debug ones use the header's first 16 bytes. Keys are little-endian
+// 128-bit numbers, so reversed for AES.
+void ModcryptKey(const unsigned char *header, unsigned char *rk) {
+  static const unsigned char magic[16] = {
+    0x79, 0x3E, 0x4F, 0x1A, 0x5F, 0x0F, 0x68, 0x2A, 0x58, 0x02, 0x59, 0x29, 0x4E, 0xFB, 0xFE, 0xFF
+  };
+  unsigned char x[16], key[16], normal[16];
+  unsigned int  sum, i;
+
+  if ((header[0x1C] & DSI_DEBUG_KEY) || (header[0x1BF] & DSI_DEVELOPER)) {
+    memcpy(normal, header, 16);
+  } else {
+    memcpy(x, "Nintendo", 8);
+    for (i = 0; i < 4; i++) x[8 + i] = x[15 - i] = header[0x0C + i];
+    // (X ^ Y) + magic, then rotated left by 42 bits
+    for (i = 0, sum = 0; i < 16; i++) {
+      sum += (x[i] ^ header[0x350 + i]) + magic[i];
+      key[i] = sum;
+      sum >>= 8;
+    }
+    for (i = 0; i < 16; i++) normal[(i + 5) & 15] = key[i] << 2 | key[(i + 15) & 15] >> 6;
+  }
+
+  for (i = 0; i < 16; i++) key[i] = normal[15 - i];
+  AesExpand(key, rk);
+}
+
+/*----------------------------------------------------------------------------*/
+// Whether any of 'length' bytes at ROM offset 'offset' are in one of the
+// header's two modcrypt areas
+bool ModcryptCovers(const unsigned char *header, unsigned int offset, unsigned int length) {
+  unsigned int area, off, len;
+
+  for (area = 0; area < 2; area++) {
+    off = *(unsigned int *)(header + 0x220 + 8 * area);
+    len = *(unsigned int *)(header + 0x224 + 8 * area);
+    if (off && len && off < offset + length && offset < off + len) return(true);
+  }
+
+  return(false);
+}
+
+/*----------------------------------------------------------------------------*/
+// Encrypts or decrypts, which is the same in CTR mode, the part of 'buffer'
+// in the header's modcrypt areas, 'buffer' being 'length' bytes at ROM offset
+// 'offset'. Each area counts from the first 16 bytes of the ARM9 (with its
+// secure area) SHA1-HMAC at 0x300 for area 1, or of the ARM7 one at 0x314
+// for area 2. Returns false when there was none.
+bool ModcryptRegion(const unsigned char *header, unsigned char *buffer, unsigned int offset, unsigned int length) {
+  unsigned char rk[176], ctr[16], block[16], *data;
+  unsigned int  area, off, len, start, end, pos, left, n, i;
+  bool          done = false;
+
+  pthread_once(&modcryptOnce, ModcryptInit);
+
+  for (area = 0; area < 2; area++) {
+    off = *(unsigned int *)(header + 0x220 + 8 * area);
+    len = *(unsigned int *)(header + 0x224 + 8 * area);
+    if (!off || !len || off >= offset + length || offset >= off + len) continue;
+
+    if (!done) ModcryptKey(header, rk);
+    done = true;
+
+    start = off > offset ? off : offset;
+    end = off + len < offset + length ? off + len : offset + length;
+    data = buffer + start - offset;
+    left = end - start;
+
+    // from the counter of the block 'start' is in, partway into it
+    pos = start - off;
+    for (i = 0; i < 16; i++) ctr[i] = header[(area ? 0x314 : 0x300) + 15 - i];
+    ModcryptAdd(ctr, pos >> 4);
+    if (pos & 15) {
+      n = 16 - (pos & 15) < left ? 16 - (pos & 15) : left;
+      memset(block, 0, 16);
+      memcpy(block + (pos & 15), data, n);
+      modcryptCtr(rk, ctr, block, 1);
+      memcpy(data, block + (pos & 15), n);
+      data += n;
+      left -= n;
+    }
+
+    modcryptCtr(rk, ctr, data, left >> 4);
+    if (left & 15) {
+      data += left & -16;
+      memset(block, 0, 16);
+      memcpy(block, data, left & 15);
+      modcryptCtr(rk, ctr, block, 1);
+      memcpy(data, block, left & 15);
+    }
+  }
+
+  return(done);
+}
+
+/*----------------------------------------------------------------------------*/
+// Decodes a BLZ buffer in memory, as the in-place decoder on the console
+// does. Returns NULL if the buffer is malformed. *safe is cleared when the
+// output would overwrite packed data not yet read when decoded in place.
+unsigned char *BLZ_Decode(unsigned char *pak_buffer, unsigned int pak_len, unsigned int *new_len, bool *safe) {
+  unsigned char *raw_buffer, *pak, *raw, *pak_end, *raw_end, *raw_top;
+  unsigned int   raw_len, len, pos, inc_len, hdr_len, enc_len, dec_len, flags, i;
+  bool           overrun;
+
+  *safe = true;
+
+  if (pak_len < BLZ_MINIM) return(NULL);
+  inc_len = *(unsigned int *)(pak_buffer + pak_len - 4);
+  if (!inc_len) {
+    raw_buffer = (unsigned char *) ArenaAlloc(NULL, pak_len);
+    memcpy(raw_buffer, pak_buffer, pak_len - 4);
+    *new_len = pak_len - 4;
+    return(raw_buffer);
+  }
+
+  if (pak_len < 8) return(NULL);
+  hdr_len = pak_buffer[pak_len - 5];
+  if ((hdr_len < 0x08) || (hdr_len > 0x0B)) return(NULL);
+  enc_len = *(unsigned int *)(pak_buffer + pak_len - 8) & 0x00FFFFFF;
+  if ((enc_len < hdr_len) || (enc_len > pak_len)) return(NULL);
+  dec_len = pak_len - enc_len;
+  raw_len = dec_len + enc_len + inc_len;
+  if (raw_len > RAW_MAXIM) return(NULL);
+
+  // every byte is written when it decodes, and it's dropped when it doesn't
+  raw_buffer = (unsigned char *) ArenaAlloc(NULL, raw_len);
+  memcpy(raw_buffer, pak_buffer, dec_len);
+
+  // both sides are walked downwards, with no inversion
+  pak = pak_buffer + pak_len - hdr_len;
+  pak_end = pak_buffer + dec_len;
+  raw = raw_top = raw_buffer + raw_len;
+  raw_end = raw_buffer + dec_len;
+  overrun = false;
+
+  // 8 tokens read at most 17 bytes and write at most 8 * 18, so whole flag
+  // groups need no bounds checks until close to the end
+  while ((pak - pak_end >= 17) && (raw - raw_end >= 8 * BLZ_F)) {
+    flags = *--pak;
+    for (i = 0; i < 8; i++, flags <<= 1) {
+      if (!(flags & BLZ_MASK)) {
+        *--raw = *--pak;
+      } else {
+        pak -= 2;
+        pos = (pak[1] << 8) | pak[0];
+        len = (pos >> 12) + BLZ_THRESHOLD + 1;
+        pos = (pos & 0xFFF) + 3;
+        raw -= len;
+        overrun |= raw + pos + len > raw_top;
+        if (overrun) break;
+        BLZ_Copy(raw, pos, len);
+      }
+      *safe &= raw - raw_buffer >= pak - pak_buffer;
+    }
+    if (overrun) break;
+  }
+
+  while (!overrun && (raw > raw_end) && (pak > pak_end)) {
+    flags = *--pak;
+    for (i = 0; (i < 8) && (raw > raw_end); i++, flags <<= 1) {
+      if (!(flags & BLZ_MASK)) {
+        if (pak == pak_end) break;
+        *--raw = *--pak;
+      } else {
+        if (pak - pak_end < 2) break;
+        pak -= 2;
+        pos = (pak[1] << 8) | pak[0];
+        len = (pos >> 12) + BLZ_THRESHOLD + 1;
+        pos = (pos & 0xFFF) + 3;
+        if (len > raw - raw_end) { overrun = true; break; }
+        raw -= len;
+        if (raw + pos + len > raw_top) { overrun = true; break; }
+        BLZ_Copy(raw, pos, len);
+      }
+      *safe &= raw - raw_buffer >= pak - pak_buffer;
+    }
+  }
+
+  if (overrun || (raw != raw_end)) {
+    free(raw_buffer);
+    return(NULL);
+  }
+
+  *new_len = raw_len;
+
+  return(raw_buffer);
+}
+
+/*----------------------------------------------------------------------------*/
+// Compresses the ROM's ARM9 binary into job->arm9, left NULL when the binary
+// can't be compressed or doesn't verify
+void BLZ_Encode(RomJob *job, int mode, BLZ_Budget *budget, int threads, bool verify, char *cacheDir) {
+  unsigned char *raw_buffer, *pak_buffer, *new_buffer;
+  unsigned int   raw_len, pak_len;
+  char          *filename = job->romName;
+
+  Log(job, "- loading header of '%s'\n", filename);
+	unsigned int arm9dst = job->rom.header.arm9dst;
+	raw_len = job->rom.header.arm9len;
+	job->a7mbk6 = job->rom.header.a7mbk6;
+	job->deviceListAddr = job->rom.header.deviceListAddr;
+
+  Log(job, "- loading ARM9 binary\n");
+  double start = Clock();
+  new_buffer = RomView(&job->rom, job->rom.header.arm9src, raw_len);
+  if (new_buffer == NULL) {
+    Log(job, "- ARM9 binary is out of the ROM\n");
+    return;
+  }
+  raw_buffer = (unsigned char *) ArenaAlloc(job->arena, raw_len);
+  memcpy(raw_buffer, new_buffer, raw_len);
+  job->stats.bytesRead += raw_len;
+  job->stats.load = Clock() - start;
+
+	start = Clock();
+	int found[ARM_SIGNATURES];
+	ArmScan(raw_buffer, raw_len, job->a7mbk6, found);
+	job->stats.scan = Clock() - start;
+
+	job->moduleParamsFound = false;
+	unsigned int moduleParamsOffset = found[ARM_MODULE_PARAMS];
+	if (found[ARM_MODULE_PARAMS] >= 0) {
+		Log(job, "- searching module params... found\n");
+		job->moduleParamsFound = true;
+		job->sdkVer[0] = *(char*)(raw_buffer + moduleParamsOffset - 1); // SDK version
+		job->sdkVer[1] = *(char*)(raw_buffer + moduleParamsOffset - 2); // SDK sub-version
+		if (*(unsigned int*)(raw_buffer + moduleParamsOffset - 8) != 0) {
+			Log(job, "- ARM9 binary already compressed\n");
+			return;
+		}
+	}
+
+	if (!job->moduleParamsFound) {
+		Log(job, "- searching module params... not found\n");
+		return;
+	} else if (moduleParamsOffset >= ARM9_PARAMS) {
+		Log(job, "- module params offset is invalid\n");
+		return;
+	} else if (raw_len < 0x4000) {
+		// all of it would be the 16KB kept as they are
+		Log(job, "- ARM9 binary is shorter than 16KB, keeping it uncompressed\n");
+		return;
+	}
+
+	ArmPatch(job, raw_buffer, found);
+
+  pak_buffer = NULL;
+  pak_len = BLZ_MAXIM + 1;
+
+  start = Clock();
+  uint64_t key = 0;
+  if (cacheDir != NULL) {
+    key = BLZ_Hash(raw_buffer, raw_len, ((uint64_t)BLZ_CACHE_VERSION << 32) | mode);
+    if (mode & BLZ_FAST) {
+      // only the same for the same budget
+      uint64_t limits[2] = {budget->growth, budget->cycles};
+      key = BLZ_Hash((unsigned char *)limits, sizeof(limits), key);
+    }
+    pak_buffer = BLZ_CacheLoad(cacheDir, key, mode, raw_len, &pak_len, job->arena);
+  }
+
+  if (pak_buffer != NULL) {
+    Log(job, "- reusing cached ARM9 binary\n");
+    job->stats.cacheHit = true;
+  } else if (mode != BLZ_EXHAUSTIVE) {
+    Log(job, "- compressing ARM9 binary\n");
+    int new_len;
+    pak_buffer = BLZ_Code(raw_buffer, raw_len, &new_len, mode, budget, threads, &job->stats.blz, job->arena);
+    pak_len = new_len;
+    if (cacheDir != NULL) BLZ_CacheStore(cacheDir, key, mode, raw_len, pak_buffer, pak_len, job);
+  } else {
+    static const int variants[] = {
+      BLZ_NORMAL, BLZ_BEST, BLZ_OPTIMAL, BLZ_NORMAL | BLZ_PADDED, BLZ_BEST | BLZ_PADDED, BLZ_OPTIMAL | BLZ_PADDED
+    };
+    static const char *names[] = {
+      "normal", "best", "optimal", "normal, padded split", "best, padded split", "optimal, padded split"
+    };
+    const int count = sizeof(variants) / sizeof(variants[0]);
+    BLZ_Task  tasks[sizeof(variants) / sizeof(variants[0])];
+    BLZ_Stats stats[sizeof(variants) / sizeof(variants[0])];
+    int       i, best = -1;
+
+    Log(job, "- compressing ARM9 binary, trying %i variants\n", count);
+    for (i = 0; i < count; i++) {
+      tasks[i].raw_buffer = raw_buffer;
+      tasks[i].raw_len = raw_len;
+      tasks[i].mode = variants[i];
+      tasks[i].budget = NULL;
+      tasks[i].threads = threads;
+      tasks[i].stats = &stats[i];
+    }
+    BLZ_CodeAll(tasks, count, count);
+
+    // the smallest one that really decodes in place
+    for (i = 0; i < count; i++) {
+      unsigned int dec_len;
+      bool safe;
+      new_buffer = BLZ_Decode(tasks[i].pak_buffer, tasks[i].pak_len, &dec_len, &safe);
+      if (new_buffer != NULL && safe && dec_len >= raw_len && !memcmp(new_buffer, raw_buffer, raw_len)
+       && (best < 0 || tasks[i].pak_len < tasks[best].pak_len)) {
+        best = i;
+      }
+      if (new_buffer != NULL) free(new_buffer);
+    }
+    if (best < 0) {
+      for (i = 0; i < count; i++) free(tasks[i].pak_buffer);
+      Log(job, "- no ARM9 variant decodes back, keeping it uncompressed\n");
+      return;
+    }
+    Log(job, "- smallest was %s\n", names[best]);
+
+    // coded on other threads, so moved into the arena here
+    pak_len = tasks[best].pak_len;
+    pak_buffer = (unsigned char *) ArenaAlloc(job->arena, pak_len);
+    memcpy(pak_buffer, tasks[best].pak_buffer, pak_len);
+    for (i = 0; i < count; i++) free(tasks[i].pak_buffer);
+    job->stats.blz = stats[best];
+    if (cacheDir != NULL) BLZ_CacheStore(cacheDir, key, mode, raw_len, pak_buffer, pak_len, job);
+  }
+  job->stats.compress = Clock() - start;
+
+	if (verify) {
+		start = Clock();
+		unsigned int dec_len;
+		bool safe;
+		new_buffer = BLZ_Decode(pak_buffer, pak_len, &dec_len, &safe);
+		if (new_buffer == NULL || dec_len < raw_len || dec_len > raw_len + 3 || memcmp(new_buffer, raw_buffer, raw_len) || !safe) {
+			Log(job, "- verifying ARM9 binary... failed, keeping it uncompressed\n");
+			if (new_buffer != NULL) free(new_buffer);
+			return;
+		}
+		Log(job, "- verifying ARM9 binary... ok\n");
+		free(new_buffer);
+		job->stats.verify = Clock() - start;
+	}
+
+	job->stats.decodeCycles = BLZ_Cycles(pak_buffer, pak_len);
+	Log(job, "- ARM9 binary decodes in about %.2f ms\n", job->stats.decodeCycles * 1000.0 / CYC_ARM9_HZ);
+
+	*(unsigned int*)(pak_buffer + moduleParamsOffset - 8) = arm9dst + pak_len;
+
+  job->arm9 = pak_buffer;
+  job->arm9Len = pak_len;
+}
+
+/*----------------------------------------------------------------------------*/
+// The input is read from its top down, as the decoder writes it, and the
+// stream is written downwards from the top of the output buffer. The part kept
+// is then moved down behind the raw bytes left as they are. The result comes
+// from 'arena' (malloc when NULL), the match finder and tables from 'arena' or
+// a local one, all given back before returning.
+unsigned char *BLZ_Code(unsigned char *raw_buffer, int raw_len, int *new_len, int mode, BLZ_Budget *budget,
+                        int threads, BLZ_Stats *stats, Arena *arena) {
+  unsigned char *pak_buffer, *pak, *pak_top, *raw_top, *flg, *tab_len, *tok_len;
+  unsigned short *tab_pos;
+  unsigned int   pak_len, inc_len, hdr_len, enc_len;
+  unsigned int   len_best, pos_best, len_next, pos_next, len_post, pos_post;
+  unsigned int   pak_tmp, raw_tmp, raw_new, raw, raw_end;
+  unsigned char  mask;
+  double         start;
+  bool           padded, nohead, fast;
+
+  BLZ_Finder     mf;
+  BLZ_Stats      st;
+  Arena          local, *tmp;
+  ArenaMark      mark;
+
+#define SEARCH(l,p) {                                         \
+  if (tab_len != NULL) {                                      \
+    l = tab_len[raw];                                         \
+    p = tab_pos[raw];                                         \
+  } else {                                                    \
+    BLZ_Search(&mf, raw_top, raw, raw_end, &l, &p);           \
+    st.searched++;                                            \
+  }                                                           \
+}
+
+  memset(&st, 0, sizeof(st));
+
+  padded = mode & BLZ_PADDED;
+  nohead = mode & BLZ_NOHEAD;
+  fast = mode & BLZ_FAST;
+  mode &= ~(BLZ_PADDED | BLZ_NOHEAD | BLZ_FAST);
+
+  if (mode == BLZ_EXHAUSTIVE || fast) mode = BLZ_OPTIMAL;
+
+  pak_tmp = 0;
+  raw_tmp = raw_len;
+
+  // fully overwritten, so not cleared
+  pak_len = raw_len + ((raw_len + 7) / 8) + 11;
+  pak_buffer = (unsigned char *) ArenaAlloc(arena, pak_len);
+  pak_top = pak_buffer + pak_len;
+  raw_top = raw_buffer + raw_len - 1;
+
+  raw_new = nohead ? raw_len : raw_len - 0x4000;
+  /* if (arm9) {
+    if (raw_len < 0x4000) {
+      printf(", WARNING: ARM9 must be greater as 16KB, switch [9] disabled");
+    } else if (
+      (*(unsigned int   *)(raw_buffer + 0x0) != 0xE7FFDEFF) ||
       (*(unsigned int   *)(raw_buffer + 0x4) != 0xE7FFDEFF) ||
       (*(unsigned int   *)(raw_buffer + 0x8) != 0xE7FFDEFF) ||
       (*(unsigned short *)(raw_buffer + 0xC) != 0xDEFF)
@@ -528,135 +2952,860 @@ char *BLZ_Code(unsigned char *raw_buffer, int raw_len, int *new_len, int best) {
         printf(", WARNING: CRC16 Secure Area 2KB do not match");
         *(unsigned short *)(raw_buffer + 0x0E) = crc;
       }
-      raw_new -= 0x4000;
+      raw_new -= 0x4000;
+    }
+  } */
+
+  if (arena != NULL) {
+    tmp = arena;
+  } else {
+    memset(&local, 0, sizeof(Arena));
+    tmp = &local;
+  }
+  mark = ArenaSave(tmp);
+
+  pthread_once(&blzScanOnce, BLZ_ScanInit);
+
+  // only the chain heads are read before being written
+  mf.head = (unsigned int *) ArenaCalloc(tmp, (1 << BLZ_HASH_BITS) * sizeof(unsigned int));
+  mf.prev = (unsigned int *) ArenaAlloc(tmp, BLZ_WINDOW * sizeof(unsigned int));
+  mf.next = 0;
+
+  tab_len = NULL;
+  tab_pos = NULL;
+  tok_len = NULL;
+
+  raw_end = raw_new;
+
+  if (mode == BLZ_OPTIMAL || threads > 1) {
+    start = Clock();
+    tab_len = (unsigned char *) ArenaAlloc(tmp, raw_new);
+    tab_pos = (unsigned short *) ArenaAlloc(tmp, raw_new * sizeof(short));
+    BLZ_Matches(raw_top, raw_end, tab_len, tab_pos, threads);
+    st.searched += raw_new;
+    st.table = Clock() - start;
+  }
+
+  if (mode == BLZ_OPTIMAL) {
+    start = Clock();
+    tok_len = (unsigned char *) ArenaAlloc(tmp, raw_new + 1);
+    if (fast) raw_end = BLZ_Fast(tab_len, tab_pos, raw_new, raw_len, tok_len, budget);
+    else      raw_end = BLZ_Optimal(tab_len, raw_new, tok_len);
+    st.parse = Clock() - start;
+  }
+
+  start = Clock();
+  pak = pak_top;
+  raw = 0;
+
+  flg = NULL;
+  mask = 0;
+
+  while (raw < raw_end) {
+    if (!(mask >>= BLZ_SHIFT)) {
+      *(flg = --pak) = 0;
+      mask = BLZ_MASK;
+    }
+
+    if (mode == BLZ_OPTIMAL) {
+      len_best = tok_len[raw];
+      pos_best = tab_pos[raw];
+    } else {
+      SEARCH(len_best, pos_best);
+    }
+
+    // LZ-CUE optimization start
+    if (mode == BLZ_BEST) {
+      if (len_best > BLZ_THRESHOLD) {
+        if (raw + len_best < raw_end) {
+          raw += len_best;
+          SEARCH(len_next, pos_next);
+          raw -= len_best - 1;
+          SEARCH(len_post, pos_post);
+          raw--;
+
+          if (len_next <= BLZ_THRESHOLD) len_next = 1;
+          if (len_post <= BLZ_THRESHOLD) len_post = 1;
+
+          if (len_best + len_next <= 1 + len_post) len_best = 1;
+        }
+      }
+    }
+    // LZ-CUE optimization end
+
+    *flg <<= 1;
+    if (len_best > BLZ_THRESHOLD) {
+      raw += len_best;
+      *flg |= 1;
+      *--pak = ((len_best - (BLZ_THRESHOLD+1)) << 4) | ((pos_best - 3) >> 8);
+      *--pak = (pos_best - 3) & 0xFF;
+      st.matches++;
+      st.matchBytes += len_best;
+    } else {
+      *--pak = *(raw_top - raw++);
+      st.literals++;
+    }
+
+    if (!padded ? pak_top - pak + raw_len - raw < pak_tmp + raw_tmp
+                : (((pak_top - pak + raw_len - raw) + 3) & -4) < pak_tmp + raw_tmp) {
+      pak_tmp = pak_top - pak;
+      raw_tmp = raw_len - raw;
+    }
+  }
+
+  while (mask && (mask != 1)) {
+    mask >>= BLZ_SHIFT;
+    *flg <<= 1;
+  }
+
+  // a local arena is left without blocks
+  ArenaRestore(tmp, mark);
+
+  st.encode = Clock() - start;
+
+  if (!pak_tmp || (raw_len + 4 < ((pak_tmp + raw_tmp + 3) & -4) + 8)) {
+    memcpy(pak_buffer, raw_buffer, raw_len);
+    pak = pak_buffer + raw_len;
+
+    while ((pak - pak_buffer) & 3) *pak++ = 0;
+
+    *(unsigned int *)pak = 0; pak += 4;
+  } else {
+    memmove(pak_buffer + raw_tmp, pak_top - pak_tmp, pak_tmp);
+    memcpy(pak_buffer, raw_buffer, raw_tmp);
+
+    pak = pak_buffer + raw_tmp + pak_tmp;
+
+    enc_len = pak_tmp;
+    hdr_len = 8;
+    inc_len = raw_len - pak_tmp - raw_tmp;
+
+    while ((pak - pak_buffer) & 3) {
+      *pak++ = 0xFF;
+      hdr_len++;
+    }
+
+    *(unsigned int *)pak = enc_len + hdr_len; pak += 3;
+    *pak++ = hdr_len;
+    *(unsigned int *)pak = inc_len - hdr_len; pak += 4;
+  }
+
+  *new_len = pak - pak_buffer;
+
+  // give back the room the worst case needed
+  if (arena == NULL) {
+    pak = (unsigned char *) realloc(pak_buffer, *new_len);
+    if (pak != NULL) pak_buffer = pak;
+  }
+
+  if (stats != NULL) *stats = st;
+
+  return(pak_buffer);
+}
+
+/*----------------------------------------------------------------------------*/
+// Longest match for position 'cur' within the previous BLZ_N bytes, nearest
+// one first. Positions count down from 'raw_top', the way the buffer is coded.
+// Walks the hash chain of the next 3 bytes instead of every offset, giving the
+// same length/offset pair as the brute-force search it replaces. A long chain
+// is left for blzScan, which goes over the rest of the window in the same order.
+void BLZ_Search(BLZ_Finder *mf, unsigned char *raw_top, unsigned int cur,
+                unsigned int raw_end, unsigned int *len_best, unsigned int *pos_best) {
+  unsigned char *raw, *ref;
+  unsigned int   max, lim, cap, len, pos, hash, chain, links;
+
+  *len_best = BLZ_THRESHOLD;
+
+  while (mf->next < cur) {
+    // the last 2 positions can't start a match and would read below the buffer
+    hash = mf->next + BLZ_THRESHOLD < raw_end ? BLZ_HASH(raw_top - mf->next) : 0;
+    mf->prev[mf->next & (BLZ_WINDOW - 1)] = mf->head[hash];
+    mf->head[hash] = ++mf->next;
+  }
+
+  if (raw_end - cur <= BLZ_THRESHOLD) return;
+
+  raw = raw_top - cur;
+  max = cur >= BLZ_N ? BLZ_N : cur;
+  lim = raw_end - cur >= BLZ_F ? BLZ_F : raw_end - cur;
+
+  links = 0;
+  for (chain = mf->head[BLZ_HASH(raw)]; chain; chain = mf->prev[(chain - 1) & (BLZ_WINDOW - 1)]) {
+    if (chain + 2 > cur) continue;   // inserted ahead by a look-ahead search
+    pos = cur - (chain - 1);
+    if (pos > max) break;
+
+    if (++links >= BLZ_CHAIN && links * BLZ_DENSITY >= pos && blzScan != NULL) {
+      blzScan(raw, pos, max, lim, cur, len_best, pos_best);
+      break;
+    }
+
+    cap = pos < lim ? pos : lim;
+    if (cap <= *len_best) continue;
+
+    ref = raw + pos;
+    if (ref[-(int)*len_best] != raw[-(int)*len_best]) continue;
+
+    for (len = 0; len < cap; len++)
+      if (raw[-(int)len] != ref[-(int)len]) break;
+
+    if (len > *len_best) {
+      *pos_best = pos;
+      if ((*len_best = len) == BLZ_F) break;
+    }
+  }
+}
+
+#ifdef BLZ_SIMD
+/*----------------------------------------------------------------------------*/
+// Match length at 'ref' for the bytes down from 'raw', at most 'cap'. The
+// first 16 bytes are compared at once when they are all in the buffer, which
+// they are when 'room' (bytes from raw down to the buffer start) allows it.
+__attribute__((target("sse2")))
+static inline unsigned int BLZ_Extend(unsigned char *raw, unsigned char *ref, unsigned int cap, unsigned int room) {
+  unsigned int len, diff;
+
+  len = 0;
+  if (room >= 16) {
+    diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(raw - 15)),
+                                             _mm_loadu_si128((__m128i *)(ref - 15)))) & 0xFFFF;
+    // bit 15 is raw[0], the first mismatch is the highest bit set
+    len = diff ? __builtin_clz(diff) - 16 : 16;
+    if (len < 16) return(len < cap ? len : cap);
+  }
+  for (; len < cap; len++)
+    if (raw[-(int)len] != ref[-(int)len]) break;
+
+  return(len < cap ? len : cap);
+}
+
+/*----------------------------------------------------------------------------*/
+// Candidates in the bitmask 'bits', window position 'pos' at bit 0, taken
+// nearest first as the chain walk would. Returns true when no later position
+// can do better.
+__attribute__((target("sse2")))
+static inline bool BLZ_Candidates(unsigned char *raw, unsigned int pos, unsigned int bits, unsigned int lim,
+                                  unsigned int room, unsigned int *len_best, unsigned int *pos_best) {
+  unsigned int cand, cap, len;
+
+  while (bits) {
+    cand = pos + __builtin_ctz(bits);
+    bits &= bits - 1;
+
+    cap = cand < lim ? cand : lim;
+    if (cap <= *len_best) continue;
+    if (raw[cand - *len_best] != raw[-(int)*len_best]) continue;
+
+    len = BLZ_Extend(raw, raw + cand, cap, room);
+    if (len > *len_best) {
+      *pos_best = cand;
+      *len_best = len;
+    }
+  }
+
+  return(*len_best >= lim);
+}
+
+/*----------------------------------------------------------------------------*/
+// Brute-force scan of window positions 'pos' to 'max' for 'raw', 16 at a time:
+// the 3 bytes down from each candidate, and the one a longer match than the
+// best so far needs, are compared with the ones from 'raw'. The candidates
+// they all match are extended. 'top' is raw's position, the most a candidate
+// can be, and the bytes above it can't be read.
+__attribute__((target("sse2")))
+static void BLZ_ScanSSE2(unsigned char *raw, unsigned int pos, unsigned int max, unsigned int lim,
+                         unsigned int top, unsigned int *len_best, unsigned int *pos_best) {
+  __m128i      b0, b1, b2, bl;
+  unsigned int bits, room, len;
+
+  if (*len_best >= lim) return;
+
+  room = lim;
+  len = *len_best;
+  b0 = _mm_set1_epi8(raw[0]);
+  b1 = _mm_set1_epi8(raw[-1]);
+  b2 = _mm_set1_epi8(raw[-2]);
+  bl = _mm_set1_epi8(raw[-(int)len]);
+
+  for (; pos + 15 <= max && pos + 15 <= top; pos += 16) {
+    bits = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(
+             _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(raw + pos)), b0),
+             _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(raw + pos - 1)), b1)), _mm_and_si128(
+             _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(raw + pos - 2)), b2),
+             _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(raw + pos - len)), bl))));
+    if (!bits) continue;
+    if (BLZ_Candidates(raw, pos, bits, lim, room, len_best, pos_best)) return;
+    if (*len_best != len) {
+      len = *len_best;
+      bl = _mm_set1_epi8(raw[-(int)len]);
+    }
+  }
+
+  // the last few, one at a time
+  for (; pos <= max; pos++) {
+    if (raw[pos] == raw[0] && raw[pos - 1] == raw[-1] && raw[pos - 2] == raw[-2]
+     && BLZ_Candidates(raw, pos, 1, lim, room, len_best, pos_best)) return;
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+// The same 32 positions at a time
+__attribute__((target("avx2")))
+static void BLZ_ScanAVX2(unsigned char *raw, unsigned int pos, unsigned int max, unsigned int lim,
+                         unsigned int top, unsigned int *len_best, unsigned int *pos_best) {
+  __m256i      b0, b1, b2, bl;
+  unsigned int bits, room, len;
+
+  if (*len_best >= lim) return;
+
+  room = lim;
+  len = *len_best;
+  b0 = _mm256_set1_epi8(raw[0]);
+  b1 = _mm256_set1_epi8(raw[-1]);
+  b2 = _mm256_set1_epi8(raw[-2]);
+  bl = _mm256_set1_epi8(raw[-(int)len]);
+
+  for (; pos + 31 <= max && pos + 31 <= top; pos += 32) {
+    bits = _mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(
+             _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(raw + pos)), b0),
+             _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(raw + pos - 1)), b1)), _mm256_and_si256(
+             _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(raw + pos - 2)), b2),
+             _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(raw + pos - len)), bl))));
+    if (!bits) continue;
+    if (BLZ_Candidates(raw, pos, bits, lim, room, len_best, pos_best)) return;
+    if (*len_best != len) {
+      len = *len_best;
+      bl = _mm256_set1_epi8(raw[-(int)len]);
+    }
+  }
+
+  BLZ_ScanSSE2(raw, pos, max, lim, top, len_best, pos_best);
+}
+#endif
+
+/*----------------------------------------------------------------------------*/
+// Picks the scan kernel once, from blzIsa or what the CPU supports
+void BLZ_ScanInit(void) {
+#ifdef BLZ_SIMD
+  __builtin_cpu_init();
+  if (blzIsa < 0) {
+    blzIsa = __builtin_cpu_supports("avx2") ? BLZ_ISA_AVX2
+           : __builtin_cpu_supports("sse2") ? BLZ_ISA_SSE2 : BLZ_ISA_SCALAR;
+  }
+  if (blzIsa == BLZ_ISA_AVX2 && !__builtin_cpu_supports("avx2")) blzIsa = BLZ_ISA_SSE2;
+  if (blzIsa == BLZ_ISA_SSE2 && !__builtin_cpu_supports("sse2")) blzIsa = BLZ_ISA_SCALAR;
+
+  if      (blzIsa == BLZ_ISA_AVX2) blzScan = BLZ_ScanAVX2;
+  else if (blzIsa == BLZ_ISA_SSE2) blzScan = BLZ_ScanSSE2;
+  else                             blzScan = NULL;
+#else
+  blzIsa = BLZ_ISA_SCALAR;
+  blzScan = NULL;
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+// Longest match at every position, counted from the top, the same pairs
+// BLZ_Search returns. Each position only reads the input before it, so the
+// buffer is cut in chunks searched by separate threads, each with its own
+// chains primed from BLZ_N bytes before the chunk.
+void BLZ_Matches(unsigned char *raw_top, unsigned int raw_end,
+                 unsigned char *tab_len, unsigned short *tab_pos, int threads) {
+  BLZ_Chunk   *chunks;
+  pthread_t   *workers;
+  unsigned int raw_len, size, i;
+
+  raw_len = raw_end;
+
+  size = (raw_len + threads - 1) / threads;
+  if (size < 0x10000) size = 0x10000;
+  threads = (raw_len + size - 1) / size;
+  if (threads < 1) threads = 1;
+
+  chunks = (BLZ_Chunk *) Memory(threads, sizeof(BLZ_Chunk));
+  workers = (pthread_t *) Memory(threads, sizeof(pthread_t));
+
+  for (i = 0; i < threads; i++) {
+    chunks[i].raw_top = raw_top;
+    chunks[i].raw_end = raw_end;
+    chunks[i].tab_len = tab_len;
+    chunks[i].tab_pos = tab_pos;
+    chunks[i].start = i * size;
+    chunks[i].end = i * size + size < raw_len ? i * size + size : raw_len;
+  }
+
+  for (i = 1; i < threads; i++)
+    if (pthread_create(&workers[i], NULL, BLZ_MatchChunk, &chunks[i])) EXIT("\nThread create error\n");
+  BLZ_MatchChunk(&chunks[0]);
+  for (i = 1; i < threads; i++)
+    pthread_join(workers[i], NULL);
+
+  free(workers);
+  free(chunks);
+}
+
+/*----------------------------------------------------------------------------*/
+void *BLZ_MatchChunk(void *arg) {
+  BLZ_Chunk   *chunk = (BLZ_Chunk *)arg;
+  BLZ_Finder   mf;
+  unsigned int len_best, pos_best, i;
+
+  mf.head = (unsigned int *) Memory(1 << BLZ_HASH_BITS, sizeof(unsigned int));
+  mf.prev = (unsigned int *) Memory(BLZ_WINDOW, sizeof(unsigned int));
+  mf.next = chunk->start > BLZ_N ? chunk->start - BLZ_N : 0;
+
+  pos_best = 0;
+  for (i = chunk->start; i < chunk->end; i++) {
+    BLZ_Search(&mf, chunk->raw_top, i, chunk->raw_end, &len_best, &pos_best);
+    chunk->tab_len[i] = len_best;
+    chunk->tab_pos[i] = pos_best;
+  }
+
+  free(mf.prev);
+  free(mf.head);
+
+  return(NULL);
+}
+
+/*----------------------------------------------------------------------------*/
+// Cost-minimal literal/match sequence, from the top of the buffer. A single pass
+// prices every prefix in bits (flag bit included) and keeps the prefix whose
+// packed bits plus the raw bytes left behind it are the smallest, which is the
+// pak_tmp/raw_tmp split BLZ_Code would otherwise look for token by token.
+// Returns the end of that prefix, token lengths are left at their start
+// positions in 'tok_len' (1 for a literal), matches use the 'tab_len' offsets.
+unsigned int BLZ_Optimal(unsigned char *tab_len, unsigned int raw_len, unsigned char *tok_len) {
+  unsigned int cost[32], len, end, next, i;
+  int          score, best;
+
+  for (i = 0; i < 32; i++) cost[i] = -1;
+  cost[0] = 0;
+
+  best = 0;
+  end = 0;
+
+  for (i = 0; ; i++) {
+    score = cost[i & 31] - 8 * i;
+    if (score < best) {
+      best = score;
+      end = i;
+    }
+    if (i == raw_len) break;
+
+    if (cost[i & 31] + BLZ_LIT_BITS < cost[(i + 1) & 31]) {
+      cost[(i + 1) & 31] = cost[i & 31] + BLZ_LIT_BITS;
+      tok_len[i + 1] = 1;
+    }
+
+    for (len = BLZ_THRESHOLD + 1; len <= tab_len[i]; len++) {
+      if (cost[i & 31] + BLZ_PAIR_BITS < cost[(i + len) & 31]) {
+        cost[(i + len) & 31] = cost[i & 31] + BLZ_PAIR_BITS;
+        tok_len[i + len] = len;
+      }
     }
-  } */
 
-  BLZ_Invert(raw_buffer, raw_len);
+    cost[i & 31] = -1;
+  }
 
-  pak = pak_buffer;
-  raw = raw_buffer;
-  raw_end = raw_buffer + raw_new;
+  // turn end positions into start positions, walking the parse backwards
+  for (i = end, len = tok_len[end]; i; len = next) {
+    i -= len;
+    next = i ? tok_len[i] : 0;
+    tok_len[i] = len;
+  }
 
-  mask = 0;
+  return(end);
+}
 
-  while (raw < raw_end) {
-    if (!(mask >>= BLZ_SHIFT)) {
-      *(flg = pak++) = 0;
-      mask = BLZ_MASK;
+/*----------------------------------------------------------------------------*/
+// Final BLZ_Code size for 'pak_tmp' coded bytes and 'raw_tmp' left as they are
+static inline unsigned int BLZ_Size(unsigned int raw_len, unsigned int pak_tmp, unsigned int raw_tmp) {
+  if (!pak_tmp || (raw_len + 4 < ((pak_tmp + raw_tmp + 3) & -4) + 8)) return(((raw_len + 3) & -4) + 4);
+
+  return(((pak_tmp + raw_tmp + 3) & -4) + 8);
+}
+
+/*----------------------------------------------------------------------------*/
+// BLZ_Optimal with tokens priced in decode cycles (CYC_ model, in 1/8ths so
+// the flag byte is shared by its 8 tokens) plus 'weight' for each bit. Gives
+// the final size and estimated decode cycles of that parse.
+unsigned int BLZ_Weigh(unsigned char *tab_len, unsigned short *tab_pos, unsigned int raw_new, unsigned int raw_len,
+                       unsigned char *tok_len, unsigned int weight, unsigned int *size, unsigned long long *cycles) {
+  uint64_t     cost[32], cyc[32], lit, pair, far;
+  unsigned int bits[32], len, end, next, i;
+  int64_t      score, best;
+
+  for (i = 0; i < 32; i++) cost[i] = -1;
+  cost[0] = cyc[0] = bits[0] = 0;
+
+  lit = 8 * (CYC_TOKEN + CYC_LITERAL) + CYC_FLAG;
+  pair = 8 * (CYC_TOKEN + CYC_MATCH) + CYC_FLAG;
+  far = 8 * CYC_FAR;
+
+  best = 0;
+  end = 0;
+  *size = BLZ_Size(raw_len, 0, raw_len);
+  *cycles = 0;
+
+  for (i = 0; ; i++) {
+    // the bytes behind the parse are left raw, costing only their bits
+    score = cost[i & 31] - (int64_t)weight * 8 * i;
+    if (score < best) {
+      best = score;
+      end = i;
+      *size = BLZ_Size(raw_len, (bits[i & 31] + 7) / 8, raw_len - i);
+      *cycles = cyc[i & 31] / 8;
     }
+    if (i == raw_new) break;
 
-    SEARCH(len_best, pos_best);
+    if (cost[i & 31] + weight * BLZ_LIT_BITS + lit < cost[(i + 1) & 31]) {
+      cost[(i + 1) & 31] = cost[i & 31] + weight * BLZ_LIT_BITS + lit;
+      cyc[(i + 1) & 31] = cyc[i & 31] + lit;
+      bits[(i + 1) & 31] = bits[i & 31] + BLZ_LIT_BITS;
+      tok_len[i + 1] = 1;
+    }
 
-    // LZ-CUE optimization start
-    if (best) {
-      if (len_best > BLZ_THRESHOLD) {
-        if (raw + len_best < raw_end) {
-          raw += len_best;
-          SEARCH(len_next, pos_next);
-          raw -= len_best - 1;
-          SEARCH(len_post, pos_post);
-          raw--;
+    for (len = BLZ_THRESHOLD + 1; len <= tab_len[i]; len++) {
+      uint64_t t = pair + 8 * CYC_COPY * len + (tab_pos[i] > CYC_NEAR ? far : 0);
+      if (cost[i & 31] + weight * BLZ_PAIR_BITS + t < cost[(i + len) & 31]) {
+        cost[(i + len) & 31] = cost[i & 31] + weight * BLZ_PAIR_BITS + t;
+        cyc[(i + len) & 31] = cyc[i & 31] + t;
+        bits[(i + len) & 31] = bits[i & 31] + BLZ_PAIR_BITS;
+        tok_len[i + len] = len;
+      }
+    }
 
-          if (len_next <= BLZ_THRESHOLD) len_next = 1;
-          if (len_post <= BLZ_THRESHOLD) len_post = 1;
+    cost[i & 31] = -1;
+  }
 
-          if (len_best + len_next <= 1 + len_post) len_best = 1;
-        }
+  for (i = end, len = tok_len[end]; i; len = next) {
+    i -= len;
+    next = i ? tok_len[i] : 0;
+    tok_len[i] = len;
+  }
+
+  return(end);
+}
+
+/*----------------------------------------------------------------------------*/
+// Parse for BLZ_FAST: the weight of a bit against a decode cycle is bisected,
+// for the fastest parse within the size budget, or the smallest within the
+// cycle ceiling. Leaves it in 'tok_len' as BLZ_Optimal does.
+unsigned int BLZ_Fast(unsigned char *tab_len, unsigned short *tab_pos, unsigned int raw_new, unsigned int raw_len,
+                      unsigned char *tok_len, BLZ_Budget *budget) {
+  BLZ_Budget          defaults = {BLZ_GROWTH, 0};
+  unsigned long long  cycles;
+  unsigned int        lo, hi, mid, size, limit, pak, pak_tmp, raw_tmp, tokens, len, i;
+
+  if (budget == NULL) budget = &defaults;
+
+  lo = 0;
+  hi = BLZ_WEIGHT;
+  if (budget->cycles) {
+    while (lo < hi) {
+      mid = (lo + hi + 1) / 2;
+      BLZ_Weigh(tab_len, tab_pos, raw_new, raw_len, tok_len, mid, &size, &cycles);
+      if (cycles <= budget->cycles) lo = mid;
+      else                          hi = mid - 1;
+    }
+  } else {
+    // BLZ_NORMAL takes the longest match at every position
+    pak = pak_tmp = tokens = 0;
+    raw_tmp = raw_len;
+    for (i = 0; i < raw_new; i += len) {
+      if (!(tokens++ & 7)) pak++;
+      len = tab_len[i] > BLZ_THRESHOLD ? tab_len[i] : 1;
+      pak += len > 1 ? 2 : 1;
+      if (pak + raw_len - i - len < pak_tmp + raw_tmp) {
+        pak_tmp = pak;
+        raw_tmp = raw_len - i - len;
       }
     }
-    // LZ-CUE optimization end
+    limit = BLZ_Size(raw_len, pak_tmp, raw_tmp);
+    limit += (unsigned long long)limit * budget->growth / 1000;
 
-    *flg <<= 1;
-    if (len_best > BLZ_THRESHOLD) {
-      raw += len_best;
-      *flg |= 1;
-      *pak++ = ((len_best - (BLZ_THRESHOLD+1)) << 4) | ((pos_best - 3) >> 8);
-      *pak++ = (pos_best - 3) & 0xFF;
-    } else {
-      *pak++ = *raw++;
+    while (lo < hi) {
+      mid = (lo + hi) / 2;
+      BLZ_Weigh(tab_len, tab_pos, raw_new, raw_len, tok_len, mid, &size, &cycles);
+      if (size <= limit) hi = mid;
+      else               lo = mid + 1;
     }
+  }
 
-#if 1
-    if (pak - pak_buffer + raw_len - (raw - raw_buffer) < pak_tmp + raw_tmp) {
-#else
-    if (
-      (((pak - pak_buffer + raw_len - (raw - raw_buffer)) + 3) & -4)
-      <
-      pak_tmp + raw_tmp
-    ) {
-#endif
-      pak_tmp = pak - pak_buffer;
-      raw_tmp = raw_len - (raw - raw_buffer);
+  return(BLZ_Weigh(tab_len, tab_pos, raw_new, raw_len, tok_len, lo, &size, &cycles));
+}
+
+/*----------------------------------------------------------------------------*/
+// Estimated ARM9 cycles to decode a BLZ buffer, from the CYC_ model. 0 for a
+// buffer stored uncompressed.
+unsigned long long BLZ_Cycles(unsigned char *pak_buffer, unsigned int pak_len) {
+  unsigned char      *pak, *pak_end;
+  unsigned long long  cycles;
+  unsigned int        inc_len, hdr_len, enc_len, left, pos, len, flags, i;
+
+  if ((pak_len < 8) || !(inc_len = *(unsigned int *)(pak_buffer + pak_len - 4))) return(0);
+  hdr_len = pak_buffer[pak_len - 5];
+  enc_len = *(unsigned int *)(pak_buffer + pak_len - 8) & 0x00FFFFFF;
+  if ((hdr_len < 0x08) || (hdr_len > 0x0B) || (enc_len < hdr_len) || (enc_len > pak_len)) return(0);
+
+  pak = pak_buffer + pak_len - hdr_len;
+  pak_end = pak_buffer + pak_len - enc_len;
+  left = enc_len + inc_len;
+  cycles = 0;
+
+  while (left && (pak > pak_end)) {
+    flags = *--pak;
+    cycles += CYC_FLAG;
+    for (i = 0; (i < 8) && left; i++, flags <<= 1) {
+      cycles += CYC_TOKEN;
+      if (!(flags & BLZ_MASK)) {
+        if (pak == pak_end) break;
+        pak--;
+        left--;
+        cycles += CYC_LITERAL;
+      } else {
+        if (pak - pak_end < 2) break;
+        pak -= 2;
+        pos = (pak[1] << 8) | pak[0];
+        len = (pos >> 12) + BLZ_THRESHOLD + 1;
+        pos = (pos & 0xFFF) + 3;
+        if (len > left) len = left;
+        left -= len;
+        cycles += CYC_MATCH + CYC_COPY * len + (pos > CYC_NEAR ? CYC_FAR : 0);
+      }
     }
   }
 
-  while (mask && (mask != 1)) {
-    mask >>= BLZ_SHIFT;
-    *flg <<= 1;
+  return(cycles);
+}
+
+/*----------------------------------------------------------------------------*/
+// Guesses the BLZ_NORMAL size of an ARM9 binary without coding all of it.
+// Up to EST_SAMPLES windows spread over it are parsed greedily, trying only
+// the last EST_WAYS positions with the same hash, and their mean is scaled
+// to the whole. 'error' gets the bound on it, from how much the windows
+// differ plus EST_BIAS.
+unsigned int BLZ_Estimate(unsigned char *raw_buffer, unsigned int raw_len, unsigned int *error) {
+  unsigned int  head[1 << EST_HASH_BITS][EST_WAYS], *slot;
+  unsigned int  body, windows, n, i, start, end, top, pos, ins, ref, len, best, bits, w;
+  double        ratio, sum, sum2, mean, var, spread;
+
+  // the 16KB head is kept as it is
+  body = raw_len > 0x4000 ? raw_len - 0x4000 : 0;
+  windows = body / EST_SAMPLE;
+  // at most 1 in 4 of them, so that it stays well ahead of reading it
+  n = (windows + 3) / 4 < EST_SAMPLES ? (windows + 3) / 4 : EST_SAMPLES;
+  if (!n) {
+    *error = 0;
+    return(((raw_len + 3) & -4) + 4);
   }
 
-  pak_len = pak - pak_buffer;
+  // positions below every window's history never match
+  memset(head, 0, sizeof(head));
+  sum = sum2 = 0;
 
-  BLZ_Invert(raw_buffer, raw_len);
-  BLZ_Invert(pak_buffer, pak_len);
+#define EST_HASH(p) (BLZ_HASH(p) >> (BLZ_HASH_BITS - EST_HASH_BITS))
 
-  if (!pak_tmp || (raw_len + 4 < ((pak_tmp + raw_tmp + 3) & -4) + 8)) {
-    pak = pak_buffer;
-    raw = raw_buffer;
-    raw_end = raw_buffer + raw_len;
+  for (i = 0; i < n; i++) {
+    start = 0x4000 + (unsigned int)((unsigned long long)i * windows / n) * EST_SAMPLE;
+    end = start + EST_SAMPLE;
+    top = end + BLZ_N < raw_len ? end + BLZ_N : raw_len;
 
-    while (raw < raw_end) *pak++ = *raw++;
+    // read top down, as BLZ_Code does, matches referring to bytes above;
+    // a position is only hashed once it's far enough above to be one
+    bits = 0;
+    ins = top - 1;
+    for (pos = end - 1; pos >= start; pos -= len) {
+      for ( ; ins > pos + BLZ_THRESHOLD; ins--) {
+        slot = head[EST_HASH(raw_buffer + ins)];
+        memmove(slot + 1, slot, (EST_WAYS - 1) * sizeof(slot[0]));
+        slot[0] = ins;
+      }
+      slot = head[EST_HASH(raw_buffer + pos)];
+      best = 0;
+      for (w = 0; w < EST_WAYS; w++) {
+        ref = slot[w];
+        if ((ref <= pos + BLZ_THRESHOLD) || (ref - pos > BLZ_N)) break;
+        for (len = 0; (len < BLZ_F) && (len <= pos - start) && (raw_buffer[ref - len] == raw_buffer[pos - len]); len++);
+        if (len > best) best = len;
+      }
+      len = best > BLZ_THRESHOLD ? best : 1;
+      bits += len > 1 ? BLZ_PAIR_BITS : BLZ_LIT_BITS;
+    }
 
-    while ((pak - pak_buffer) & 3) *pak++ = 0;
+    ratio = bits / 8.0 / EST_SAMPLE;
+    // no window codes bigger than it is, the encoder would leave it raw
+    if (ratio > 1) ratio = 1;
+    sum += ratio;
+    sum2 += ratio * ratio;
+  }
 
-    *(unsigned int *)pak = 0; pak += 4;
-  } else {
-    tmp = (unsigned char *) Memory(raw_tmp + pak_tmp + 11, sizeof(char));
+#undef EST_HASH
 
-    for (len = 0; len < raw_tmp; len++)
-      tmp[len] = raw_buffer[len];
+  mean = sum / n * EST_SCALE / 1000;
+  var = n > 1 ? (sum2 - sum * sum / n) / (n - 1) / n * (1 - (double)n / windows) : 0;
+  // its square root, without libm
+  for (spread = var > 0 ? 1 : 0, i = 0; spread && i < 64; i++) spread = (spread + var / spread) / 2;
+  // two standard errors, as the windows are a sample of the body
+  *error = (2 * spread * EST_SCALE / 1000 + mean * EST_BIAS / 1000) * body + 0.5;
 
-    for (len = 0; len < pak_tmp; len++)
-      tmp[raw_tmp + len] = pak_buffer[len + pak_len - pak_tmp];
+  return(0x4000 + (unsigned int)(mean * body + 0.5) + 8);
+}
 
-    pak = pak_buffer;
-    pak_buffer = tmp;
+/*----------------------------------------------------------------------------*/
+// Runs the tasks on up to 'threads' threads, each taking the next task left
+typedef struct {
+  BLZ_Task        *tasks;
+  int              count, next;
+  pthread_mutex_t  lock;
+} BLZ_TaskList;
 
-    free(pak);
+static void *BLZ_CodeWorker(void *arg) {
+  BLZ_TaskList *list = (BLZ_TaskList *)arg;
+  int           i;
 
-    pak = pak_buffer + raw_tmp + pak_tmp;
+  while (1) {
+    pthread_mutex_lock(&list->lock);
+    i = list->next++;
+    pthread_mutex_unlock(&list->lock);
+    if (i >= list->count) break;
+    BLZ_CodeTask(&list->tasks[i]);
+  }
 
-    enc_len = pak_tmp;
-    hdr_len = 8;
-    inc_len = raw_len - pak_tmp - raw_tmp;
+  return(NULL);
+}
 
-    while ((pak - pak_buffer) & 3) {
-      *pak++ = 0xFF;
-      hdr_len++;
-    }
+void BLZ_CodeAll(BLZ_Task *tasks, int count, int threads) {
+  BLZ_TaskList list;
+  pthread_t   *workers;
+  int          i;
 
-    *(unsigned int *)pak = enc_len + hdr_len; pak += 3;
-    *pak++ = hdr_len;
-    *(unsigned int *)pak = inc_len - hdr_len; pak += 4;
+  if (threads > count) threads = count;
+  if (threads <= 1) {
+    for (i = 0; i < count; i++) BLZ_CodeTask(&tasks[i]);
+    return;
   }
 
-  *new_len = pak - pak_buffer;
+  list.tasks = tasks;
+  list.count = count;
+  list.next = 0;
+  pthread_mutex_init(&list.lock, NULL);
+
+  workers = (pthread_t *) Memory(threads, sizeof(pthread_t));
+  for (i = 0; i < threads; i++) {
+    if (pthread_create(&workers[i], NULL, BLZ_CodeWorker, &list)) EXIT("\nThread create error\n");
+  }
+  for (i = 0; i < threads; i++) pthread_join(workers[i], NULL);
+  free(workers);
+
+  pthread_mutex_destroy(&list.lock);
+}
+
+/*----------------------------------------------------------------------------*/
+void *BLZ_CodeTask(void *arg) {
+  BLZ_Task *task = (BLZ_Task *)arg;
+
+  task->pak_buffer = BLZ_Code(task->raw_buffer, task->raw_len, &task->pak_len, task->mode, task->budget,
+                              task->threads, (BLZ_Stats *)task->stats, NULL);
+
+  return(NULL);
+}
+
+/*----------------------------------------------------------------------------*/
+// 64-bit hash of a buffer, used as the ARM9 cache key
+uint64_t BLZ_Hash(unsigned char *buffer, unsigned int length, uint64_t seed) {
+  uint64_t hash, word;
+  unsigned int i;
+
+  hash = seed ^ (length * 0x9E3779B97F4A7C15ull);
+  for (i = 0; i + 8 <= length; i += 8) {
+    memcpy(&word, buffer + i, 8);
+    word *= 0x87C37B91114253D5ull;
+    word = (word << 31) | (word >> 33);
+    hash ^= word * 0x4CF5AD432745937Full;
+    hash = ((hash << 27) | (hash >> 37)) * 5 + 0x52DCE729;
+  }
+  for (word = 0; i < length; i++) word = (word << 8) | buffer[i];
+  hash ^= word * 0x87C37B91114253D5ull;
+
+  hash ^= hash >> 33;
+  hash *= 0xFF51AFD7ED558CCDull;
+  hash ^= hash >> 33;
+  hash *= 0xC4CEB9FE1A85EC53ull;
+  hash ^= hash >> 33;
+
+  return(hash);
+}
+
+/*----------------------------------------------------------------------------*/
+// Cached compressed ARM9 for a key, before its module params fixup. NULL if
+// there is none or it was written for something else.
+unsigned char *BLZ_CacheLoad(char *dir, uint64_t key, int mode, unsigned int raw_len, unsigned int *pak_len,
+                             Arena *arena) {
+  unsigned char *pak_buffer;
+  unsigned int   header[6];
+  char           filename[300];
+  FILE          *fp;
+  ArenaMark      mark;
+
+  snprintf(filename, sizeof(filename), "%s/%016llx.blz", dir, (unsigned long long)key);
+  if ((fp = fopen(filename, "rb")) == NULL) return(NULL);
+
+  pak_buffer = NULL;
+  if ((fread(header, 1, sizeof(header), fp) == sizeof(header))
+   && (header[0] == BLZ_CACHE_MAGIC) && (header[1] == BLZ_CACHE_VERSION) && (header[2] == mode)
+   && (header[3] == raw_len) && (header[4] == (unsigned int)key) && (header[5] == (unsigned int)(key >> 32))) {
+    fseek(fp, 0, SEEK_END);
+    *pak_len = ftell(fp) - sizeof(header);
+    fseek(fp, sizeof(header), SEEK_SET);
+    if ((*pak_len >= BLZ_MINIM) && (*pak_len <= BLZ_MAXIM)) {
+      mark = ArenaSave(arena);
+      pak_buffer = (unsigned char *) ArenaAlloc(arena, *pak_len);
+      if (fread(pak_buffer, 1, *pak_len, fp) != *pak_len) {
+        ArenaRestore(arena, mark);
+        pak_buffer = NULL;
+      }
+    }
+  }
+  fclose(fp);
 
   return(pak_buffer);
 }
 
 /*----------------------------------------------------------------------------*/
-void BLZ_Invert(char *buffer, int length) {
-  char *bottom, ch;
+// Written under a temporary name first, so that a ROM running at the same
+// time never sees half an entry. The name is unique to this process and
+// store, as ROM names may have folders in them. A failure is only logged once.
+void BLZ_CacheStore(char *dir, uint64_t key, int mode, unsigned int raw_len, unsigned char *pak_buffer,
+                    unsigned int pak_len, RomJob *job) {
+  unsigned int header[6] = {
+    BLZ_CACHE_MAGIC, BLZ_CACHE_VERSION, mode, raw_len, (unsigned int)key, (unsigned int)(key >> 32)
+  };
+  char  filename[300], tmpname[300];
+  FILE *fp;
+  bool  ok, warn;
 
-  bottom = buffer + length - 1;
+  pthread_mutex_lock(&cacheLock);
+  snprintf(tmpname, sizeof(tmpname), "%s/%016llx.%i-%u.tmp", dir, (unsigned long long)key, (int)getpid(), cacheStores++);
+  pthread_mutex_unlock(&cacheLock);
+  snprintf(filename, sizeof(filename), "%s/%016llx.blz", dir, (unsigned long long)key);
 
-  while (buffer < bottom) {
-    ch = *buffer;
-    *buffer++ = *bottom;
-    *bottom-- = ch;
+  ok = (fp = fopen(tmpname, "wb")) != NULL;
+  if (ok) {
+    ok = (fwrite(header, 1, sizeof(header), fp) == sizeof(header))
+      && (fwrite(pak_buffer, 1, pak_len, fp) == pak_len);
+    if ((fclose(fp) == EOF) || !ok || rename(tmpname, filename)) {
+      remove(tmpname);
+      ok = false;
+    }
   }
+  if (ok) return;
+
+  pthread_mutex_lock(&cacheLock);
+  warn = !cacheFailed;
+  cacheFailed = true;
+  pthread_mutex_unlock(&cacheLock);
+  if (warn) Log(job, "- could not write to the cache folder '%s'\n", dir);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -677,6 +3826,574 @@ short BLZ_CRC16(unsigned char *buffer, unsigned int length) {
   return(crc);
 }
 
+/*----------------------------------------------------------------------------*/
+// Monotonic time in seconds
+double Clock(void) {
+  struct timespec ts;
+
+#ifdef _WIN32
+  timespec_get(&ts, TIME_UTC);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+
+  return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+#if defined(TWL_BENCH) || defined(TWL_TEST)
+/*----------------------------------------------------------------------------*/
+static uint32_t BenchRandom(uint32_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return(*state);
+}
+
+/*----------------------------------------------------------------------------*/
+// Deterministic test data, for the benchmark and the self-tests: ARM words
+// and THUMB halfwords drawn from a skewed vocabulary with repeated sequences,
+// data tables, or a mix of all three.
+void BenchCorpus(unsigned char *buffer, unsigned int length, int kind, uint32_t seed) {
+  static const uint32_t common[] = {
+    0xE92D4010, 0xE8BD8010, 0xE12FFF1E, 0xE3A00000, 0xE59F0000, 0xE1A00000,
+    0xE3500000, 0x0A000000, 0xE5900000, 0xE5801000, 0xEB000000, 0xE2800001
+  };
+  uint32_t      vocab[256], state, r, word;
+  unsigned int  pos, len, src, width, block;
+  int           part;
+
+  state = seed;
+  for (pos = 0; pos < 256; pos++) vocab[pos] = BenchRandom(&state);
+  for (pos = 0; pos < sizeof(common) / sizeof(common[0]); pos++) vocab[pos] = common[pos];
+
+  for (pos = 0; pos < length; ) {
+    part = kind < 3 ? kind : (pos >> 14) % 3;
+    block = kind < 3 ? length - pos : 0x4000 - (pos & 0x3FFF);
+    if (block > length - pos) block = length - pos;
+
+    for (block += pos; pos < block; ) {
+      r = BenchRandom(&state);
+      if (part == 2) {
+        // tables of small values, pointers and zero fill
+        if ((r & 7) < 3) {
+          for (len = (r >> 8) & 0xFF; len-- && pos < block; ) buffer[pos++] = 0;
+        } else if ((r & 7) < 6) {
+          word = 0x02000000 + ((r >> 8) & 0xFFFC);
+          for (len = 0; len < 4 && pos < block; len++) buffer[pos++] = word >> (len * 8);
+        } else {
+          buffer[pos++] = (r >> 8) & 0x1F;
+        }
+        continue;
+      }
+
+      width = part ? 2 : 4;
+      if (((r & 15) == 0) && (pos > 64)) {
+        // repeat a recent sequence
+        len = 4 + ((r >> 4) & 31);
+        src = pos - 4 - ((r >> 9) % (pos - 4 < 0x1000 ? pos - 4 : 0x1000));
+        while (len-- && pos < block) buffer[pos++] = buffer[src++];
+        continue;
+      }
+      if ((r & 15) < 10)      word = vocab[(r >> 4) & 15];
+      else if ((r & 15) < 14) word = vocab[(r >> 4) & 255];
+      else                    word = BenchRandom(&state);
+      if (part) word = (word ^ (word >> 16)) & 0xFFFF;
+      for (len = 0; len < width && pos < block; len++) buffer[pos++] = word >> (len * 8);
+    }
+  }
+}
+
+#endif
+
+#ifdef TWL_BENCH
+/*----------------------------------------------------------------------------*/
+// Compression benchmark, built with -DTWL_BENCH. BLZ_Code is run in every mode
+// over synthetic buffers generated here, so no ROMs are needed, and each
+// result is printed as one JSON (or CSV) line.
+static const char *benchModes[BLZ_MODES + 1] = {"normal", "best", "optimal", "fast"};
+static const char *benchKinds[] = {"arm", "thumb", "data", "mixed"};
+static const char *benchIsas[] = {"scalar", "sse2", "avx2"};
+static BLZ_Budget  benchBudget = {BLZ_GROWTH, 0};
+
+#define BENCH_KINDS (int)(sizeof(benchKinds) / sizeof(benchKinds[0]))
+
+/*----------------------------------------------------------------------------*/
+int Bench(int argc, char **argv) {
+  unsigned char *raw;
+  unsigned int   raw_len = 1 << 20;
+  int            threads = 1, repeat = 3, kind, mode, arg;
+  int            failed = 0;
+  int            only = -1;
+  bool           csv = false;
+
+  for (arg = 1; arg < argc; arg++) {
+    if      (!strcmp(argv[arg], "--csv"))                  csv = true;
+    else if (!strcmp(argv[arg], "-s") && arg + 1 < argc)   raw_len = atoi(argv[++arg]) << 10;
+    else if (!strcmp(argv[arg], "-t") && arg + 1 < argc)   threads = atoi(argv[++arg]);
+    else if (!strcmp(argv[arg], "-r") && arg + 1 < argc)   repeat = atoi(argv[++arg]);
+    else if (!strcmp(argv[arg], "--mode") && arg + 1 < argc) {
+      for (only = 0; only <= BLZ_MODES && strcmp(argv[arg + 1], benchModes[only]); only++);
+      if (only > BLZ_MODES) EXIT("Unknown mode\n");
+      arg++;
+    }
+    else if (!strcmp(argv[arg], "--isa") && arg + 1 < argc) {
+      for (blzIsa = 0; blzIsa <= BLZ_ISA_AVX2 && strcmp(argv[arg + 1], benchIsas[blzIsa]); blzIsa++);
+      if (blzIsa > BLZ_ISA_AVX2) EXIT("Unknown ISA\n");
+      arg++;
+    }
+    else if (!strcmp(argv[arg], "--fast") && arg + 1 < argc) {
+      benchBudget.growth = atof(argv[++arg]) * 10 + 0.5;
+      benchBudget.cycles = 0;
+    }
+    else if (!strcmp(argv[arg], "--fast-cycles") && arg + 1 < argc) {
+      benchBudget.cycles = strtoull(argv[++arg], NULL, 10);
+    }
+    else {
+      printf("Usage: bench [-s KB] [-t threads] [-r repeats] [--mode normal|best|optimal|fast]\n"
+             "             [--fast P | --fast-cycles N] [--isa scalar|sse2|avx2] [--csv]\n");
+      return(-1);
+    }
+  }
+  // BLZ_Code keeps the first 16KB as they are
+  if ((raw_len < 0x4000) || (raw_len > RAW_MAXIM)) EXIT("Bad size, 16KB at least\n");
+  if (threads < 1) threads = 1;
+  if (repeat < 1) repeat = 1;
+
+  // the kernel actually used, when the one asked for isn't supported
+  pthread_once(&blzScanOnce, BLZ_ScanInit);
+
+  if (csv) printf("corpus,mode,isa,threads,raw_len,pak_len,ratio,seconds,mb_per_s,cycles_per_byte,decode_cycles,"
+                  "peak_kb,hash,ok\n");
+
+  raw = (unsigned char *) Memory(raw_len, sizeof(char));
+  for (kind = 0; kind < BENCH_KINDS; kind++) {
+    BenchCorpus(raw, raw_len, kind, 0x2A8D4F11 + kind);
+    for (mode = 0; mode <= BLZ_MODES; mode++) {
+      if ((only >= 0) && (mode != only)) continue;
+#ifdef _WIN32
+      if (!BenchRun(raw, raw_len, kind, mode, threads, repeat, csv)) failed++;
+#else
+      // in a child process, so that its peak memory is its own
+      fflush(stdout);
+      pid_t pid = fork();
+      if (pid < 0) EXIT("\nFork error\n");
+      if (!pid) {
+        bool ok = BenchRun(raw, raw_len, kind, mode, threads, repeat, csv);
+        fflush(stdout);
+        _exit(ok ? 0 : 1);
+      }
+      int status;
+      if (waitpid(pid, &status, 0) < 0) EXIT("\nWait error\n");
+      if (WIFSIGNALED(status)) {
+        fprintf(stderr, "Bench %s/%s killed by signal %i\n", benchKinds[kind], benchModes[mode], WTERMSIG(status));
+        failed++;
+      } else if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "Bench %s/%s did not decode back\n", benchKinds[kind], benchModes[mode]);
+        failed++;
+      }
+#endif
+    }
+  }
+  free(raw);
+
+  return(failed ? 1 : 0);
+}
+
+/*----------------------------------------------------------------------------*/
+bool BenchRun(unsigned char *raw, unsigned int raw_len, int kind, int mode, int threads, int repeat, bool csv) {
+  unsigned char *pak, *dec;
+  unsigned int   dec_len;
+  int            pak_len, i;
+  double         start, best;
+  long long      peak;
+  bool           safe, ok;
+  uint64_t       cycles, least, hash, decode;
+
+  best = 0;
+  least = 0;
+  pak = NULL;
+  for (i = 0; i < repeat; i++) {
+    if (pak != NULL) free(pak);
+#if defined(__x86_64__) || defined(__i386__)
+    cycles = __rdtsc();
+#endif
+    start = Clock();
+    pak = BLZ_Code(raw, raw_len, &pak_len, mode < BLZ_MODES ? mode : BLZ_OPTIMAL | BLZ_FAST, &benchBudget,
+                   threads, NULL, NULL);
+    start = Clock() - start;
+#if defined(__x86_64__) || defined(__i386__)
+    cycles = __rdtsc() - cycles;
+#else
+    cycles = 0;
+#endif
+    if (!i || (start < best)) best = start;
+    if (!i || (cycles < least)) least = cycles;
+  }
+
+  dec = BLZ_Decode(pak, pak_len, &dec_len, &safe);
+  ok = (dec != NULL) && (dec_len >= raw_len) && !memcmp(dec, raw, raw_len) && safe;
+  if (dec != NULL) free(dec);
+  // the same for every kernel, or one of them is wrong
+  hash = BLZ_Hash(pak, pak_len, 0);
+  decode = BLZ_Cycles(pak, pak_len);
+  free(pak);
+
+  peak = -1;
+#ifndef _WIN32
+  struct rusage usage;
+  if (!getrusage(RUSAGE_SELF, &usage)) peak = usage.ru_maxrss;
+#endif
+
+  if (csv) {
+    printf("%s,%s,%s,%i,%u,%i,%.4f,%.6f,%.3f,%.2f,%llu,%lld,%016llx,%i\n",
+           benchKinds[kind], benchModes[mode], benchIsas[blzIsa], threads, raw_len, pak_len,
+           (double)pak_len / raw_len, best, raw_len / best / 1e6,
+           (double)least / raw_len, (unsigned long long)decode, peak, (unsigned long long)hash, ok);
+  } else {
+    printf("{\"corpus\": \"%s\", \"mode\": \"%s\", \"isa\": \"%s\", \"threads\": %i, \"raw_len\": %u, "
+           "\"pak_len\": %i, \"ratio\": %.4f, \"seconds\": %.6f, \"mb_per_s\": %.3f, \"cycles_per_byte\": %.2f, "
+           "\"decode_cycles\": %llu, \"peak_kb\": %lld, \"hash\": \"%016llx\", \"ok\": %s}\n",
+           benchKinds[kind], benchModes[mode], benchIsas[blzIsa], threads, raw_len, pak_len,
+           (double)pak_len / raw_len, best, raw_len / best / 1e6,
+           (double)least / raw_len, (unsigned long long)decode, peak, (unsigned long long)hash, ok ? "true" : "false");
+  }
+
+  return(ok);
+}
+#endif
+
+#ifdef TWL_TEST
+/*----------------------------------------------------------------------------*/
+// Self-tests, built with -DTWL_TEST. The ROMs and buffers they need are made
+// here, each check prints one line and the exit code is how many failed.
+static int testFailures;
+
+void TestCheck(bool ok, const char *name) {
+  printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+  if (!ok) testFailures++;
+}
+
+/*----------------------------------------------------------------------------*/
+int Test(void) {
+  TestDonors();
+  TestShortArm9();
+  TestFastOverlay();
+  TestEstimate();
+  TestModcrypt();
+
+  printf("%i failed\n", testFailures);
+
+  return(testFailures);
+}
+
+/*----------------------------------------------------------------------------*/
+// A ROM laid out as the SDK does it: an ARM9 with SDK 5.0 module params, an
+// overlay of 'ovl_len' bytes when not 0, an ARM7, the FNT, FAT, banner and
+// one file, then for a DSi ROM an ARM9i and an ARM7i half the ARM7's size in
+// its TWL region. Free it with free().
+unsigned char *TestRom(unsigned int *size, unsigned int arm9_len, unsigned int ovl_len, unsigned int arm7_len,
+                       bool dsi, uint32_t seed) {
+  static const unsigned char fnt[] = {8, 0, 0, 0, 0, 0, 1, 0, 6, 'f', '0', '.', 'b', 'i', 'n', 0};
+  unsigned char *rom;
+  unsigned int   a9, ovt, ovl, a7, fnto, fat, bnr, file, ntr_end, a9i, a7i, pos;
+
+#define TEST_ALIGN(x, a) (((x) + (a) - 1) & -(a))
+  pos = 0x4000;
+  a9 = pos;
+  pos += arm9_len + (ovl_len ? 12 : 0);
+  ovt = pos = TEST_ALIGN(pos, 0x200);
+  if (ovl_len) pos += OVT_ENTRY;
+  ovl = pos = TEST_ALIGN(pos, 0x200);
+  pos += ovl_len;
+  a7 = pos = TEST_ALIGN(pos, 0x200);
+  pos += arm7_len;
+  fnto = pos = TEST_ALIGN(pos, 0x200);
+  pos += sizeof(fnt);
+  fat = pos = TEST_ALIGN(pos, 0x200);
+  pos += ovl_len ? 16 : 8;
+  bnr = pos = TEST_ALIGN(pos, 0x200);
+  pos += 0x840;
+  file = pos = TEST_ALIGN(pos, 0x200);
+  pos += 0x200;
+  ntr_end = pos;
+  a9i = pos = TEST_ALIGN(pos, 0x80000);
+  pos += dsi ? 0x1000 : 0;
+  a7i = pos = TEST_ALIGN(pos, 0x400);
+  pos += dsi ? arm7_len / 2 : 0;
+  *size = dsi ? pos : ntr_end;
+
+  rom = (unsigned char *) Memory(*size, sizeof(char));
+  BenchCorpus(rom + a9, arm9_len, 0, seed);
+  memset(rom + a9 + 0x8F0, 0, 16);
+  rom[a9 + 0x8FF] = DONOR_SDK;
+  *(unsigned int *)(rom + a9 + 0x900) = 0xDEC00621;
+  *(unsigned int *)(rom + a9 + 0x904) = 0x2106C0DE;
+  if (ovl_len) {
+    *(unsigned int *)(rom + a9 + arm9_len) = 0xDEC00621;
+    *(unsigned int *)(rom + a9 + arm9_len + 4) = 0x900;
+    *(unsigned int *)(rom + ovt + 0x04) = 0x02100000;
+    *(unsigned int *)(rom + ovt + 0x08) = ovl_len;
+    *(unsigned int *)(rom + ovt + 0x18) = 1;
+    BenchCorpus(rom + ovl, ovl_len, 1, seed + 1);
+    *(unsigned int *)(rom + fat + 8) = ovl;
+    *(unsigned int *)(rom + fat + 12) = ovl + ovl_len;
+  }
+  BenchCorpus(rom + a7, arm7_len, 0, seed + 2);
+  memcpy(rom + fnto, fnt, sizeof(fnt));
+  *(unsigned int *)(rom + fat) = file;
+  *(unsigned int *)(rom + fat + 4) = file + 0x200;
+  rom[bnr] = 1;
+  BenchCorpus(rom + file, 0x200, 2, seed + 3);
+
+  memcpy(rom, "TWLOPT TEST KTSE", 16);
+  *(unsigned int *)(rom + 0x20) = a9;
+  *(unsigned int *)(rom + 0x24) = 0x02000800;
+  *(unsigned int *)(rom + 0x28) = 0x02000000;
+  *(unsigned int *)(rom + 0x2C) = arm9_len;
+  *(unsigned int *)(rom + 0x30) = a7;
+  *(unsigned int *)(rom + 0x34) = 0x02380000;
+  *(unsigned int *)(rom + 0x38) = 0x02380000;
+  *(unsigned int *)(rom + 0x3C) = arm7_len;
+  *(unsigned int *)(rom + 0x40) = fnto;
+  *(unsigned int *)(rom + 0x44) = sizeof(fnt);
+  *(unsigned int *)(rom + 0x48) = fat;
+  *(unsigned int *)(rom + 0x4C) = ovl_len ? 16 : 8;
+  *(unsigned int *)(rom + 0x50) = ovl_len ? ovt : 0;
+  *(unsigned int *)(rom + 0x54) = ovl_len ? OVT_ENTRY : 0;
+  *(unsigned int *)(rom + 0x68) = bnr;
+  *(unsigned int *)(rom + 0x80) = ntr_end;
+  *(unsigned int *)(rom + 0x84) = 0x4000;
+  if (dsi) {
+    BenchCorpus(rom + a9i, 0x1000, 0, seed + 4);
+    BenchCorpus(rom + a7i, arm7_len / 2, 0, seed + 5);
+    rom[0x12] = 0x03;
+    rom[0x1C] = 0x03;
+    *(unsigned short *)(rom + 0x90) = a9i >> 19;
+    *(unsigned short *)(rom + 0x92) = a9i >> 19;
+    *(unsigned int *)(rom + 0x1A0) = 0x00403000;
+    *(unsigned int *)(rom + 0x1C0) = a9i;
+    *(unsigned int *)(rom + 0x1C8) = 0x02400000;
+    *(unsigned int *)(rom + 0x1CC) = 0x1000;
+    *(unsigned int *)(rom + 0x1D0) = a7i;
+    *(unsigned int *)(rom + 0x1D4) = 0x0380F780;
+    *(unsigned int *)(rom + 0x1D8) = 0x02E80000;
+    *(unsigned int *)(rom + 0x1DC) = arm7_len / 2;
+    *(unsigned int *)(rom + 0x210) = *size;
+  }
+  *(unsigned short *)(rom + 0x15E) = BLZ_CRC16(rom, 0x15E);
+#undef TEST_ALIGN
+
+  return(rom);
+}
+
+/*----------------------------------------------------------------------------*/
+// A DSi ROM takes the donor's ARM7 binaries, an NTR ROM keeps its ARM7 and
+// only has its ARM9 compressed
+void TestDonors(void) {
+  TWL_Donors    *donors;
+  TWL_Result     result;
+  unsigned char *donor, *rom;
+  unsigned int   donor_len, len, a7;
+  bool           ok;
+
+  donor = TestRom(&donor_len, 0x4000, 0, 0x2000, true, 100);
+  donors = TWL_DonorsNew();
+  TestCheck(TWL_DonorsAdd(donors, "sdk50", donor, donor_len, false), "donor added");
+
+  rom = TestRom(&len, 0x20000, 0, 0x8000, true, 1);
+  ok = TWL_Optimize(rom, len, donors, NULL, &result);
+  TestCheck(ok && result.arm9 != NULL && result.arm7Len == 0x2000 && result.arm7iLen == 0x1000,
+            "DSi ROM, ARM7 binaries from the donor");
+  TWL_ResultFree(&result);
+  free(rom);
+
+  rom = TestRom(&len, 0x20000, 0, 0x8000, false, 2);
+  ok = TWL_Optimize(rom, len, donors, NULL, &result) && result.arm9 != NULL && result.arm7 == NULL
+    && result.rom != NULL && !result.rom[0x12];
+  if (ok) {
+    a7 = *(unsigned int *)(result.rom + 0x30);
+    ok = *(unsigned int *)(result.rom + 0x3C) == 0x8000 && a7 + 0x8000 <= result.romLen
+      && !memcmp(result.rom + a7, rom + *(unsigned int *)(rom + 0x30), 0x8000);
+  }
+  TestCheck(ok, "NTR ROM, no donor and its own ARM7 kept");
+  TWL_ResultFree(&result);
+  free(rom);
+
+  TWL_DonorsFree(donors);
+  free(donor);
+}
+
+/*----------------------------------------------------------------------------*/
+// An ARM9 under 16KB is all head, so it's left as it is and the rest of the
+// ROM still optimized
+void TestShortArm9(void) {
+  TWL_Donors    *donors;
+  TWL_Result     result;
+  unsigned char *donor, *rom;
+  unsigned int   donor_len, len;
+  bool           ok;
+
+  donor = TestRom(&donor_len, 0x4000, 0, 0x2000, true, 100);
+  donors = TWL_DonorsNew();
+  TWL_DonorsAdd(donors, "sdk50", donor, donor_len, false);
+
+  rom = TestRom(&len, 0x3000, 0, 0x8000, true, 3);
+  ok = TWL_Optimize(rom, len, donors, NULL, &result) && result.arm9 == NULL && result.arm7 != NULL
+    && result.rom != NULL && *(unsigned int *)(result.rom + 0x2C) == 0x3000;
+  TestCheck(ok, "ARM9 under 16KB kept uncompressed");
+  TWL_ResultFree(&result);
+  free(rom);
+
+  TWL_DonorsFree(donors);
+  free(donor);
+}
+
+/*----------------------------------------------------------------------------*/
+// Overlays are coded without the 16KB head, which the fast parse has to keep
+// too when one is smaller than that
+void TestFastOverlay(void) {
+  TWL_Options    options;
+  TWL_Result     result;
+  unsigned char *rom, *ovt, *fat, *dec;
+  unsigned int   len, off, dec_len;
+  bool           ok, safe;
+
+  rom = TestRom(&len, 0x8000, 0x3000, 0x4000, true, 4);
+  memset(&options, 0, sizeof(options));
+  options.mode = TWL_FAST;
+  options.overlays = true;
+  ok = TWL_Optimize(rom, len, NULL, &options, &result) && result.rom != NULL;
+  if (ok) {
+    ovt = result.rom + *(unsigned int *)(result.rom + 0x50);
+    fat = result.rom + *(unsigned int *)(result.rom + 0x48);
+    off = *(unsigned int *)(fat + 8);
+    ok = (ovt[0x1F] & OVT_COMPRESSED) && (*(unsigned int *)(ovt + 0x1C) & 0xFFFFFF) < 0x3000;
+  }
+  if (ok) {
+    dec = BLZ_Decode(result.rom + off, *(unsigned int *)(fat + 12) - off, &dec_len, &safe);
+    ok = dec != NULL && safe && dec_len == 0x3000
+      && !memcmp(dec, rom + *(unsigned int *)(rom + *(unsigned int *)(rom + 0x48) + 8), 0x3000);
+    if (dec != NULL) free(dec);
+  }
+  TestCheck(ok, "fast mode, overlay under 16KB compressed and decoded back");
+  TWL_ResultFree(&result);
+  free(rom);
+}
+
+/*----------------------------------------------------------------------------*/
+// --estimate's size and bound against what BLZ_NORMAL really makes, on each
+// kind of bench buffer at two sizes
+void TestEstimate(void) {
+  static const char *names[] = {"arm", "thumb", "data", "mixed"};
+  static const unsigned int sizes[] = {0x80000, 0x200000};
+  unsigned char *raw, *pak;
+  unsigned int   raw_len, est, error, i;
+  int            pak_len, kind;
+  char           name[64];
+
+  raw = (unsigned char *) Memory(sizes[1], sizeof(char));
+  for (i = 0; i < 2; i++) {
+    raw_len = sizes[i];
+    for (kind = 0; kind < 4; kind++) {
+      BenchCorpus(raw, raw_len, kind, 0x5EED + kind);
+      est = BLZ_Estimate(raw, raw_len, &error);
+      pak = BLZ_Code(raw, raw_len, &pak_len, BLZ_NORMAL, NULL, 1, NULL, NULL);
+      free(pak);
+      snprintf(name, sizeof(name), "estimate within its bound, %s, %uKB", names[kind], raw_len >> 10);
+      TestCheck(error > 0 && est <= pak_len + error && pak_len <= est + error, name);
+    }
+  }
+  free(raw);
+}
+
+/*----------------------------------------------------------------------------*/
+// Modcrypt against answers worked out apart from this code (the key scrambler
+// and AES-128-CTR as documented for the DSi), with each CTR kernel there is
+void TestModcrypt(void) {
+  static const unsigned char retail[16] = {
+    0x1D, 0x34, 0x32, 0xE8, 0x37, 0x71, 0x14, 0xA9, 0xEA, 0x37, 0x0A, 0x4F, 0xB3, 0x12, 0x31, 0x0B
+  };
+  static const unsigned char debug[16] = {
+    0x45, 0x53, 0x54, 0x4B, 0x20, 0x54, 0x53, 0x45, 0x54, 0x20, 0x54, 0x50, 0x4F, 0x4C, 0x57, 0x54
+  };
+  // keystream blocks 0 and 2 of area 1, 0 and 1 of area 2
+  static const unsigned char stream[4][16] = {
+    {0x9A, 0xAF, 0xA5, 0x3B, 0x51, 0xFC, 0xBC, 0x37, 0x5C, 0xD4, 0x18, 0x20, 0xBC, 0x31, 0xA9, 0xA0},
+    {0xC0, 0xFD, 0xAF, 0xC0, 0x7E, 0x8F, 0x41, 0x64, 0x11, 0x9E, 0x19, 0x08, 0xFE, 0x89, 0xCB, 0x40},
+    {0x15, 0x59, 0x27, 0xBE, 0x63, 0xED, 0x4A, 0x9B, 0x3E, 0xE2, 0x2A, 0x33, 0xB8, 0x04, 0x56, 0x1A},
+    {0x52, 0x6C, 0xF8, 0xF0, 0xFA, 0x28, 0x58, 0x05, 0xAD, 0x42, 0x9D, 0xB4, 0x06, 0xE1, 0x77, 0x7B}
+  };
+  ModcryptFn     kernels[2], saved;
+  const char    *names[2];
+  unsigned char *header, rk[176], buffer[0x100], plain[0x100];
+  unsigned int   i, k, count;
+  char           name[64];
+  bool           ok;
+
+  header = (unsigned char *) Memory(DSI_HEADER, sizeof(char));
+  memcpy(header, "TWLOPT TEST KTSE", 16);
+  for (i = 0; i < 16; i++) {
+    header[0x300 + i] = 0x11 * i + 0x0F;
+    // all ones below the top bit, so counting carries through both halves
+    header[0x314 + i] = i < 15 ? 0xFF : 0x7F;
+    header[0x350 + i] = 0x1F * i + 7;
+  }
+  *(unsigned int *)(header + 0x220) = 0x10000;
+  *(unsigned int *)(header + 0x224) = 0x4B;
+  *(unsigned int *)(header + 0x228) = 0x20000;
+  *(unsigned int *)(header + 0x22C) = 0x20;
+
+  ModcryptKey(header, rk);
+  TestCheck(!memcmp(rk, retail, 16), "modcrypt, key X and key Y scrambled");
+  header[0x1C] |= DSI_DEBUG_KEY;
+  ModcryptKey(header, rk);
+  TestCheck(!memcmp(rk, debug, 16), "modcrypt, debug key");
+  header[0x1C] &= ~DSI_DEBUG_KEY;
+
+  pthread_once(&modcryptOnce, ModcryptInit);
+  saved = modcryptCtr;
+  count = 0;
+  kernels[count] = ModcryptPortable;
+  names[count++] = "portable";
+#ifdef BLZ_SIMD
+  if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("ssse3")) {
+    kernels[count] = ModcryptAESNI;
+    names[count++] = "AES-NI";
+  }
+#endif
+
+  for (k = 0; k < count; k++) {
+    modcryptCtr = kernels[k];
+
+    // zeros come out as the keystream, counting from 0x300 and 0x314
+    memset(buffer, 0, sizeof(buffer));
+    ok = ModcryptRegion(header, buffer, 0x10000, 0x40)
+      && !memcmp(buffer, stream[0], 16) && !memcmp(buffer + 32, stream[1], 16);
+    memset(buffer, 0, sizeof(buffer));
+    ok = ok && ModcryptRegion(header, buffer, 0x10023, 13) && !memcmp(buffer, stream[1] + 3, 13);
+    memset(buffer, 0, sizeof(buffer));
+    ok = ok && ModcryptRegion(header, buffer, 0x20000, 0x20)
+      && !memcmp(buffer, stream[2], 16) && !memcmp(buffer + 16, stream[3], 16);
+    snprintf(name, sizeof(name), "modcrypt, %s, counters", names[k]);
+    TestCheck(ok, name);
+
+    // an area from partway into the buffer, ending partway into a block
+    BenchCorpus(plain, sizeof(plain), 0, 0x5EED);
+    memcpy(buffer, plain, sizeof(plain));
+    ok = ModcryptRegion(header, buffer, 0xFFC0, sizeof(buffer))
+      && !memcmp(buffer, plain, 0x40) && memcmp(buffer + 0x40, plain + 0x40, 0x4B)
+      && !memcmp(buffer + 0x8B, plain + 0x8B, sizeof(plain) - 0x8B);
+    for (i = 0; ok && i < 16; i++) ok = (buffer[0x40 + i] ^ plain[0x40 + i]) == stream[0][i];
+    ok = ok && ModcryptRegion(header, buffer, 0xFFC0, sizeof(buffer)) && !memcmp(buffer, plain, sizeof(plain));
+    snprintf(name, sizeof(name), "modcrypt, %s, decrypted and encrypted back", names[k]);
+    TestCheck(ok, name);
+  }
+
+  modcryptCtr = saved;
+  free(header);
+}
+#endif
+
 /*----------------------------------------------------------------------------*/
 /*--  EOF                                           Copyright (C) 2011 CUE  --*/
 /*----------------------------------------------------------------------------*/
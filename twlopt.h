@@ -0,0 +1,87 @@
+/*----------------------------------------------------------------------------*/
+/*--  twlopt.h - TWL-ROM-Optimize on memory buffers                         --*/
+/*--                                                                        --*/
+/*--  This program is free software: you can redistribute it and/or modify  --*/
+/*--  it under the terms of the GNU General Public License as published by  --*/
+/*--  the Free Software Foundation, either version 3 of the License, or     --*/
+/*--  (at your option) any later version.                                   --*/
+/*----------------------------------------------------------------------------*/
+
+#ifndef TWLOPT_H
+#define TWLOPT_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*----------------------------------------------------------------------------*/
+#define TWL_NORMAL     0         // ARM9 compression modes, as --normal and so on
+#define TWL_BEST       1
+#define TWL_OPTIMAL    2
+#define TWL_EXHAUSTIVE 3
+#define TWL_FAST       4         // as --fast or --fast-cycles, see growth and maxCycles
+#define TWL_NOHEAD     0x20      // flag for TWL_Compress, no 16KB ARM9 head kept uncompressed
+
+/*----------------------------------------------------------------------------*/
+// What TWL_Optimize does, all zero gives the command line defaults
+typedef struct {
+  int         mode;             // TWL_NORMAL to TWL_FAST
+  unsigned int growth;          // TWL_FAST: permille over TWL_NORMAL allowed, 0 = 5 (0.5%)
+  unsigned long long maxCycles; // TWL_FAST: the smallest ARM9 decoding in this many cycles instead
+  int         threads;          // threads for the ARM9 compression, 0 = 1
+  bool        verify;           // decode compressed binaries back, keep the originals if they differ
+  bool        overlays;         // also compress the ARM9 overlays
+  const char *cacheDir;         // compressed ARM9 cache folder, NULL if none
+  void      (*log)(void *user, const char *line); // progress lines, NULL for none
+  void       *user;
+} TWL_Options;
+
+// A ROM as the triage sees it, from its header and the start of its ARM9
+typedef struct {
+  bool moduleParams;            // found, nothing below is set otherwise
+  int  sdkVer[2];
+  bool arm9Compressed;
+  bool cameraWifi;              // uses the camera or wireless, per its header
+} TWL_Info;
+
+// Everything TWL_Optimize made. The ARM7 binaries belong to the donors and
+// stay valid as long as they do; the rest is freed with TWL_ResultFree.
+typedef struct {
+  unsigned char *rom;           // the rebuilt ROM, NULL when its layout isn't understood
+  unsigned int   romLen;
+  unsigned char *arm9;          // the compressed ARM9, NULL when it was left alone (as when under 16KB)
+  unsigned int   arm9Len;
+  unsigned long long arm9Cycles; // its estimated decode time at 67MHz, 0 if not compressed
+  const unsigned char *arm7, *arm7i; // the donor's, NULL without one
+  unsigned int   arm7Len, arm7iLen;
+  unsigned int   a7mbk6;        // header 0x1A0 and 0x1D4 to go with them
+  unsigned int   deviceListAddr;
+} TWL_Result;
+
+typedef struct TWL_Donors TWL_Donors;
+
+/*----------------------------------------------------------------------------*/
+// Donor ROMs, shared by any number of TWL_Optimize calls at once
+TWL_Donors *TWL_DonorsNew(void);
+int   TWL_DonorsLoad(TWL_Donors *donors, const char *dir);
+bool  TWL_DonorsAdd(TWL_Donors *donors, const char *name, const unsigned char *rom, unsigned int size,
+                    bool cameraWifi);
+void  TWL_DonorsFree(TWL_Donors *donors);
+
+bool  TWL_Inspect(const unsigned char *rom, unsigned int size, TWL_Info *info);
+bool  TWL_Optimize(const unsigned char *rom, unsigned int size, TWL_Donors *donors,
+                   const TWL_Options *options, TWL_Result *result);
+void  TWL_ResultFree(TWL_Result *result);
+
+unsigned char *TWL_Compress(const unsigned char *raw, unsigned int rawLen, unsigned int *pakLen, int mode,
+                            int threads);
+unsigned char *TWL_Decompress(const unsigned char *pak, unsigned int pakLen, unsigned int *rawLen);
+int   TWL_PatchArm9(unsigned char *arm9, unsigned int length, unsigned int a7mbk6);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif